@@ -0,0 +1,302 @@
+#include "fr.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Append mode: runes missing from an existing atlas and its binary
+ * metrics are rasterized into the free space left around the glyphs
+ * already there, or into new pages, so that existing texture
+ * coordinates never change and existing glyph records keep their order.
+ */
+
+#define MAX_PAGES 256
+
+struct page {
+	struct bitmap *bitmap;
+	struct space_map space;
+	int dirty; /* has new glyphs */
+};
+
+/* Runes already in the atlas, sorted, per requested render size */
+struct present_runes {
+	uint32_t *runes;
+	int count;
+};
+
+static int compare_runes(const void *a, const void *b)
+{
+	uint32_t ra = *(const uint32_t *)a;
+	uint32_t rb = *(const uint32_t *)b;
+
+	return (ra > rb) - (ra < rb);
+}
+
+static int skip_present(uint32_t rune, int k, void *data)
+{
+	const struct present_runes *present = data;
+
+	return bsearch(&rune, present[k].runes, present[k].count,
+		       sizeof(uint32_t), compare_runes) != NULL;
+}
+
+/* Returns the pixel coordinate of a quantized texture coordinate */
+static int st_to_pixel(double st, int size)
+{
+	uint32_t q = st * (double)UINT16_MAX;
+
+	/* Quantization truncates, so round up to the pixel boundary. */
+	return (q * (uint64_t)size + UINT16_MAX - 1) / UINT16_MAX;
+}
+
+/*
+ * Sets the atlas box of an existing glyph from its texture coordinates.
+ * Returns 0 or 1 if the glyph was not placed in the atlas.
+ */
+static int restore_placement(struct raster_glyph *glyph, int width, int height)
+{
+	const struct glyph_metrics *metrics = &glyph->metrics;
+
+	glyph->x = st_to_pixel(metrics->st0[0], width);
+	glyph->y = st_to_pixel(metrics->st0[1], height);
+	glyph->bitmap.width = st_to_pixel(metrics->st1[0], width) - glyph->x;
+	glyph->bitmap.height = st_to_pixel(metrics->st1[1], height) - glyph->y;
+
+	return glyph->bitmap.width <= 0 || glyph->bitmap.height <= 0;
+}
+
+static struct page *add_page(struct page *pages, int *num_pages,
+			     struct bitmap *bitmap, int padding)
+{
+	struct page *page;
+
+	if (*num_pages == MAX_PAGES)
+		return NULL;
+
+	page = &pages[(*num_pages)++];
+	page->bitmap = bitmap;
+	page->dirty = 0;
+	space_map_init(&page->space, bitmap->width, bitmap->height, padding);
+
+	return page;
+}
+
+void rasterize_font_appended(struct raster_context *ctx, const struct fr *fr)
+{
+	struct size_group *old_groups, *groups;
+	struct present_runes *present;
+	struct raster_glyph *glyph, *next;
+	struct raster_glyph *head = NULL;
+	struct raster_glyph **tail = &head;
+	struct page pages[MAX_PAGES];
+	int num_old_groups, num_groups;
+	int num_pages = 0, num_old_pages = 0, num_loaded_pages;
+	int num_present = 0, num_added = 0, num_new_pages;
+	int width, height;
+	int i, k, p, n;
+
+	old_groups = read_metrics(fr->metrics_filename, &num_old_groups);
+	if (!old_groups)
+		die("unable to read metrics %s", fr->metrics_filename);
+
+	/* Pages are all the size of the first one. */
+	struct bitmap *bitmap = read_atlas(fr->atlas_filename);
+	if (!bitmap)
+		die("unable to read atlas %s", fr->atlas_filename);
+	width = bitmap->width;
+	height = bitmap->height;
+	if (bitmap->channels != ctx->effects.channels)
+		die("the atlas %s has %d channels, the effects need %d",
+		    fr->atlas_filename, bitmap->channels, ctx->effects.channels);
+	if (width != fr->atlas_width || height != fr->atlas_height)
+		warning("using the %dx%d size of the existing atlas",
+			width, height);
+	add_page(pages, &num_pages, bitmap, fr->padding);
+
+	for (i = 0; i < num_old_groups; i++)
+		for (glyph = old_groups[i].glyphs; glyph; glyph = glyph->next)
+			if (glyph->metrics.page >= num_old_pages)
+				num_old_pages = glyph->metrics.page + 1;
+
+	for (p = 1; p < num_old_pages; p++) {
+		char *filename = page_filename(fr->atlas_filename, p);
+		bitmap = read_atlas(filename);
+		if (!bitmap || bitmap->width != width || bitmap->height != height ||
+		    bitmap->channels != ctx->effects.channels)
+			die("unable to read atlas page %s", filename);
+		add_page(pages, &num_pages, bitmap, fr->padding);
+		free(filename);
+	}
+
+	/*
+	 * Rebuild the free space of every page from the boxes of the
+	 * existing glyphs. Those which never made it into the atlas are
+	 * dropped and rasterized again.
+	 */
+	for (i = 0; i < num_old_groups; i++) {
+		struct raster_glyph **link = &old_groups[i].glyphs;
+
+		while ((glyph = *link)) {
+			if (restore_placement(glyph, width, height)) {
+				*link = glyph->next;
+				old_groups[i].num_glyphs--;
+				free(glyph);
+				continue;
+			}
+			space_map_occupy(&pages[glyph->metrics.page].space,
+					 glyph->x, glyph->y,
+					 glyph->bitmap.width, glyph->bitmap.height);
+			link = &glyph->next;
+		}
+	}
+
+	/* Only runes missing from their size group get rasterized. */
+	present = calloc(fr->num_sizes, sizeof(*present));
+	if (!present)
+		die("out of memory");
+	for (k = 0; k < fr->num_sizes; k++) {
+		for (i = 0; i < num_old_groups; i++)
+			if (old_groups[i].pixel_height == fr->pixel_heights[k])
+				break;
+		if (i == num_old_groups)
+			continue;
+
+		present[k].runes = malloc(sizeof(uint32_t) * (old_groups[i].num_glyphs + 1));
+		if (!present[k].runes)
+			die("out of memory");
+		for (glyph = old_groups[i].glyphs; glyph; glyph = glyph->next)
+			present[k].runes[present[k].count++] = glyph->rune;
+		qsort(present[k].runes, present[k].count, sizeof(uint32_t),
+		      compare_runes);
+	}
+
+	ctx->skip_rune = skip_present;
+	ctx->skip_data = present;
+	for (k = 0; k < fr->num_sizes; k++) {
+		if (rasterize_size(ctx, k, fr))
+			die("%s", ctx->failure);
+		num_present += present[k].count;
+	}
+
+	num_loaded_pages = num_pages;
+
+	/*
+	 * New glyphs go into the first page with enough free space, or a
+	 * new page once none has.
+	 */
+	for (glyph = ctx->glyphs[0]; glyph; glyph = glyph->next) {
+		if (glyph->shared) {
+			if (glyph->shared->x < 0)
+				continue;
+			glyph->x = glyph->shared->x;
+			glyph->y = glyph->shared->y;
+			glyph->metrics.page = glyph->shared->metrics.page;
+			blit_glyph(pages[glyph->metrics.page].bitmap, glyph);
+			num_added++;
+			continue;
+		}
+		for (p = 0; p < num_pages; p++)
+			if (!space_map_place(&pages[p].space, glyph))
+				break;
+		if (p == num_pages) {
+			struct page *page;
+			bitmap = create_tiled_bitmap(width, height, fr->tile_size,
+						     ctx->effects.channels);
+			if (!bitmap)
+				die("out of memory");
+			page = add_page(pages, &num_pages, bitmap, fr->padding);
+			if (!page || space_map_place(&page->space, glyph)) {
+				warning("rune U+%04X does not fit in the atlas",
+					glyph->rune);
+				continue;
+			}
+		}
+
+		glyph->metrics.page = p;
+		blit_glyph(pages[p].bitmap, glyph);
+		pages[p].dirty = 1;
+		num_added++;
+	}
+	num_new_pages = num_pages - num_loaded_pages;
+
+	/*
+	 * Existing size groups keep their glyphs first, followed by the new
+	 * ones of the same size; new sizes come last. Everything is chained
+	 * into a single list so that the context frees it all, old glyphs
+	 * having no pixels.
+	 */
+	groups = calloc(num_old_groups + fr->num_sizes, sizeof(*groups));
+	if (!groups)
+		die("out of memory");
+	memcpy(groups, old_groups, sizeof(*groups) * num_old_groups);
+	num_groups = num_old_groups;
+
+	for (k = 0; k < fr->num_sizes; k++) {
+		struct size_group *added = &ctx->groups[k];
+
+		for (i = 0; i < num_groups; i++)
+			if (groups[i].pixel_height == added->pixel_height)
+				break;
+		if (i == num_groups)
+			groups[num_groups++] = *added;
+		else
+			groups[i].num_glyphs += added->num_glyphs;
+	}
+
+	/* Relink: each group's old glyphs, then its new glyphs. */
+	for (i = 0; i < num_groups; i++) {
+		struct size_group *added = NULL;
+		int num_old = 0;
+
+		for (k = 0; k < fr->num_sizes; k++)
+			if (ctx->groups[k].pixel_height == groups[i].pixel_height)
+				added = &ctx->groups[k];
+		if (i < num_old_groups)
+			num_old = old_groups[i].num_glyphs;
+
+		glyph = i < num_old_groups ? old_groups[i].glyphs : NULL;
+		for (n = 0; n < num_old; n++, glyph = next) {
+			next = glyph->next;
+			*tail = glyph;
+			tail = &glyph->next;
+		}
+		glyph = added ? added->glyphs : NULL;
+		for (n = 0; added && n < added->num_glyphs; n++, glyph = next) {
+			next = glyph->next;
+			*tail = glyph;
+			tail = &glyph->next;
+		}
+		groups[i].glyphs = num_old ? old_groups[i].glyphs :
+				   (added ? added->glyphs : NULL);
+	}
+	*tail = NULL;
+	ctx->glyphs[0] = head;
+
+	for (p = 0; p < num_pages; p++) {
+		if (pages[p].bitmap->failed)
+			die("out of memory");
+		if (pages[p].dirty) {
+			char *filename = page_filename(fr->atlas_filename, p);
+			if (write_atlas(pages[p].bitmap, filename, output_flags(fr)))
+				error("writing %s", filename);
+			free(filename);
+		}
+		space_map_done(&pages[p].space);
+		destroy_bitmap(pages[p].bitmap);
+	}
+	if (write_metrics(groups, num_groups, fr->metrics_filename, fr->formats,
+			  output_flags(fr)))
+		error("writing %s", fr->metrics_filename);
+
+	if (fr->option_verbose)
+		printf("%d runes already in the atlas, %d glyphs appended "
+		       "(%d new pages)\nDone.\n",
+		       num_present, num_added, num_new_pages);
+
+	for (k = 0; k < fr->num_sizes; k++)
+		free(present[k].runes);
+	free(present);
+	free(groups);
+	free(old_groups);
+}
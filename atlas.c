@@ -0,0 +1,510 @@
+#include "fr.h"
+#include "bitmap.h"
+#include "error.h"
+
+#include <limits.h>
+#include <png.h>
+#include <stdio.h>
+
+void packer_init(struct packer *packer, int width, int height, int padding)
+{
+	packer->width = width;
+	packer->height = height;
+	packer->padding = padding;
+	packer->pen_x = padding;
+	packer->pen_y = padding;
+	packer->line_height = 0;
+	packer->full = 0;
+}
+
+/*
+ * Places a glyph on the current line of the atlas, starting a new line
+ * when it does not fit. Once a glyph does not fit anymore, the atlas is
+ * full and no further glyph is placed so that glyphs keep their order.
+ * Glyphs sharing the pixels of another one take its place.
+ * Returns 0 if the glyph was placed or 1 if it was not.
+ */
+int packer_place(struct packer *packer, struct raster_glyph *glyph)
+{
+	int padding = packer->padding;
+
+	if (glyph->shared) {
+		glyph->x = glyph->shared->x;
+		glyph->y = glyph->shared->y;
+		return glyph->x < 0;
+	}
+
+	if (packer->full)
+		return 1;
+
+	if (glyph->bitmap.width + padding * 2 > packer->width) {
+		packer->full = 1;
+		return 1;
+	}
+
+	if (packer->pen_x + glyph->bitmap.width + padding > packer->width) {
+		/* Start a new line */
+		packer->pen_x = padding;
+		packer->pen_y += packer->line_height + padding;
+		packer->line_height = 0;
+	}
+	if (packer->pen_y + glyph->bitmap.height + padding > packer->height) {
+		/* Bitmap is too small */
+		packer->full = 1;
+		return 1;
+	}
+
+	if (glyph->bitmap.height > packer->line_height)
+		packer->line_height = glyph->bitmap.height;
+
+	glyph->x = packer->pen_x;
+	glyph->y = packer->pen_y;
+
+	packer->pen_x += glyph->bitmap.width + padding;
+	return 0;
+}
+
+/*
+ * Places the glyphs on lines from the top left corner of the atlas.
+ * Returns numbers of glyphs actually placed, the others keep a negative
+ * position.
+ */
+int pack_glyphs(struct raster_glyph *glyph, int atlas_width, int atlas_height,
+		int padding)
+{
+	struct packer packer;
+	int i = 0;
+
+	packer_init(&packer, atlas_width, atlas_height, padding);
+	for (; glyph; glyph = glyph->next) {
+		if (packer_place(&packer, glyph))
+			break;
+		i++;
+	}
+
+	return i;
+}
+
+static void add_free_rect(struct space_map *map, int x, int y,
+			  int width, int height)
+{
+	if (width <= 0 || height <= 0)
+		return;
+
+	if (map->count == map->capacity) {
+		map->capacity = map->capacity ? map->capacity * 2 : 64;
+		map->free = realloc(map->free, sizeof(struct rect) * map->capacity);
+		if (!map->free)
+			die("out of memory");
+	}
+
+	map->free[map->count].x = x;
+	map->free[map->count].y = y;
+	map->free[map->count].width = width;
+	map->free[map->count].height = height;
+	map->count++;
+}
+
+/* Returns whether a contains b */
+static int rect_contains(const struct rect *a, const struct rect *b)
+{
+	return b->x >= a->x && b->y >= a->y &&
+	       b->x + b->width <= a->x + a->width &&
+	       b->y + b->height <= a->y + a->height;
+}
+
+static int rect_overlaps(const struct rect *a, const struct rect *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+	       a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+void space_map_init(struct space_map *map, int width, int height, int padding)
+{
+	memset(map, 0, sizeof(*map));
+	map->padding = padding;
+	add_free_rect(map, padding, padding, width - padding, height - padding);
+}
+
+void space_map_done(struct space_map *map)
+{
+	free(map->free);
+	memset(map, 0, sizeof(*map));
+}
+
+/* Removes free rectangles contained in another one */
+static void prune_free_rects(struct space_map *map)
+{
+	int i, j;
+
+	for (i = 0; i < map->count; i++) {
+		for (j = i + 1; j < map->count; j++) {
+			if (rect_contains(&map->free[j], &map->free[i])) {
+				map->free[i] = map->free[--map->count];
+				i--;
+				break;
+			}
+			if (rect_contains(&map->free[i], &map->free[j]))
+				map->free[j--] = map->free[--map->count];
+		}
+	}
+}
+
+/* Removes a glyph box, and the padding following it, from the free space */
+void space_map_occupy(struct space_map *map, int x, int y, int width, int height)
+{
+	struct rect used = {
+		x, y, width + map->padding, height + map->padding
+	};
+	int count = map->count;
+	int i, split = 0;
+
+	/*
+	 * Every free rectangle overlapping the used one is replaced by the
+	 * (up to four) maximal rectangles around it.
+	 */
+	for (i = 0; i < count; ) {
+		struct rect f = map->free[i];
+
+		if (!rect_overlaps(&f, &used)) {
+			i++;
+			continue;
+		}
+
+		map->free[i] = map->free[--count];
+		map->free[count] = map->free[--map->count];
+		split = 1;
+
+		add_free_rect(map, f.x, f.y, used.x - f.x, f.height);
+		add_free_rect(map, used.x + used.width, f.y,
+			      f.x + f.width - used.x - used.width, f.height);
+		add_free_rect(map, f.x, f.y, f.width, used.y - f.y);
+		add_free_rect(map, f.x, used.y + used.height,
+			      f.width, f.y + f.height - used.y - used.height);
+	}
+
+	if (split)
+		prune_free_rects(map);
+}
+
+/*
+ * Places a glyph in the free rectangle leaving the shortest side after
+ * it (best short side fit).
+ * Returns 0 if the glyph was placed or 1 if no free rectangle fits it.
+ */
+int space_map_place(struct space_map *map, struct raster_glyph *glyph)
+{
+	int width = glyph->bitmap.width + map->padding;
+	int height = glyph->bitmap.height + map->padding;
+	int best_short = INT_MAX;
+	int best_long = INT_MAX;
+	int best = -1;
+	int i;
+
+	for (i = 0; i < map->count; i++) {
+		const struct rect *f = &map->free[i];
+		int dw = f->width - width;
+		int dh = f->height - height;
+		int short_side = dw < dh ? dw : dh;
+		int long_side = dw < dh ? dh : dw;
+
+		if (dw < 0 || dh < 0)
+			continue;
+		if (short_side < best_short ||
+		    (short_side == best_short && long_side < best_long)) {
+			best = i;
+			best_short = short_side;
+			best_long = long_side;
+		}
+	}
+
+	if (best < 0)
+		return 1;
+
+	glyph->x = map->free[best].x;
+	glyph->y = map->free[best].y;
+	space_map_occupy(map, glyph->x, glyph->y,
+			 glyph->bitmap.width, glyph->bitmap.height);
+	return 0;
+}
+
+/*
+ * Copies the placement of src glyphs onto dst glyphs when every glyph
+ * box matches and no glyph shares the pixels of another one.
+ * Returns 0 on success or 1 if the boxes differ.
+ */
+int share_packing(struct raster_glyph *dst, const struct raster_glyph *src)
+{
+	const struct raster_glyph *a;
+	struct raster_glyph *b;
+
+	for (a = src, b = dst; a && b; a = a->next, b = b->next)
+		if (a->bitmap.width != b->bitmap.width ||
+		    a->bitmap.height != b->bitmap.height ||
+		    a->shared || b->shared)
+			return 1;
+	if (a || b)
+		return 1;
+
+	for (a = src, b = dst; a; a = a->next, b = b->next) {
+		b->x = a->x;
+		b->y = a->y;
+	}
+
+	return 0;
+}
+
+/*
+ * Blits a placed glyph into the atlas, frees its pixels and fills its
+ * texture coordinates. Glyphs sharing the pixels of another one only
+ * get their coordinates.
+ */
+void blit_glyph(struct bitmap *atlas, struct raster_glyph *glyph)
+{
+	double atlas_scale[2] = {
+		1.0 / (double)atlas->width,
+		1.0 / (double)atlas->height
+	};
+
+	if (!glyph->shared)
+		bitmap_blit(atlas, &glyph->bitmap, glyph->x, glyph->y);
+	bitmap_free_pixels(&glyph->bitmap);
+
+	/* Build texture coordinates according to atlas scale. */
+	double st0[2];
+	double st1[2];
+
+	struct glyph_metrics *metrics = &glyph->metrics;
+	st0[0] = (double)glyph->x;
+	st0[1] = (double)glyph->y;
+	st1[0] = (double)(glyph->x + glyph->bitmap.width);
+	st1[1] = (double)(glyph->y + glyph->bitmap.height);
+
+	metrics->st0[0] = st0[0] * atlas_scale[0];
+	metrics->st0[1] = st0[1] * atlas_scale[1];
+	metrics->st1[0] = st1[0] * atlas_scale[0];
+	metrics->st1[1] = st1[1] * atlas_scale[1];
+}
+
+/* Blits the placed glyphs into the atlas and fills texture coordinates */
+void fill_atlas_and_metrics(struct bitmap *atlas, struct raster_glyph *glyph)
+{
+	for (; glyph; glyph = glyph->next)
+		if (glyph->x >= 0)
+			blit_glyph(atlas, glyph);
+}
+
+static void png_output_write(png_structp png_ptr, png_bytep data,
+			     png_size_t length)
+{
+	output_write(png_get_io_ptr(png_ptr), data, length);
+}
+
+static void png_output_flush(png_structp png_ptr)
+{
+}
+
+/* Png color types of the atlas channels */
+static const int color_types[] = {
+	[1] = PNG_COLOR_TYPE_GRAY,
+	[2] = PNG_COLOR_TYPE_GRAY_ALPHA,
+	[3] = PNG_COLOR_TYPE_RGB,
+	[4] = PNG_COLOR_TYPE_RGB_ALPHA,
+};
+
+/*
+ * Opens the atlas png file and writes its header, rows are then written
+ * top to bottom with png_stream_rows.
+ * Returns 0 (no error) or 1.
+ */
+int png_stream_open(struct png_stream *ps, const char *filename,
+		    int width, int height, int channels, int flags)
+{
+	memset(ps, 0, sizeof(*ps));
+	ps->width = width;
+	ps->height = height;
+
+	if (output_open(&ps->out, filename, flags))
+		return 1;
+
+	ps->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+					      NULL, NULL, NULL);
+	if (!ps->png_ptr)
+		goto failure;
+
+	ps->info_ptr = png_create_info_struct(ps->png_ptr);
+	if (!ps->info_ptr)
+		goto failure;
+
+	if (setjmp(png_jmpbuf(ps->png_ptr)))
+		goto failure;
+
+	/* Set image attributes */
+	png_set_IHDR(ps->png_ptr,
+		     ps->info_ptr,
+		     width,
+		     height,
+		     8, // Depth, bpp
+		     color_types[channels],
+		     PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT,
+		     PNG_FILTER_TYPE_DEFAULT);
+
+	png_set_write_fn(ps->png_ptr, &ps->out, png_output_write,
+			 png_output_flush);
+	png_write_info(ps->png_ptr, ps->info_ptr);
+
+	return 0;
+
+failure:
+	png_destroy_write_struct(&ps->png_ptr, &ps->info_ptr);
+	ps->out.failed = 1;
+	output_close(&ps->out);
+	ps->failed = 1;
+	return 1;
+}
+
+/* Writes the rows y0 to y1 (excluded) of the bitmap */
+void png_stream_rows(struct png_stream *ps, const struct bitmap *bp,
+		     int y0, int y1)
+{
+	int y;
+
+	if (ps->failed)
+		return;
+
+	if (setjmp(png_jmpbuf(ps->png_ptr))) {
+		ps->failed = 1;
+		return;
+	}
+
+	if (!bp->tile_size) {
+		for (y = y0; y < y1; y++)
+			png_write_row(ps->png_ptr, bitmap_get_pixel(bp, 0, y));
+		return;
+	}
+
+	/* Tiled bitmaps are gathered one row of tiles at a time. */
+	if (!ps->rows) {
+		ps->rows = malloc(sizeof(uint8_t) * bp->width * bp->tile_size *
+				  bp->channels);
+		if (!ps->rows) {
+			ps->failed = 1;
+			return;
+		}
+	}
+	while (y0 < y1) {
+		int y2 = (y0 / bp->tile_size + 1) * bp->tile_size;
+		if (y2 > y1)
+			y2 = y1;
+
+		bitmap_copy_rows(bp, y0, y2, ps->rows);
+		for (y = y0; y < y2; y++)
+			png_write_row(ps->png_ptr,
+				      ps->rows + (y - y0) * bp->width * bp->channels);
+		y0 = y2;
+	}
+}
+
+/*
+ * Finishes the png file and releases the stream.
+ * Returns 0 (no error) or 1 if anything went wrong since opening it.
+ */
+int png_stream_close(struct png_stream *ps)
+{
+	if (!ps->out.fp)
+		return 1;
+
+	if (!ps->failed) {
+		if (setjmp(png_jmpbuf(ps->png_ptr)))
+			ps->failed = 1;
+		else
+			png_write_end(ps->png_ptr, ps->info_ptr);
+	}
+
+	png_destroy_write_struct(&ps->png_ptr, &ps->info_ptr);
+	if (ps->failed)
+		ps->out.failed = 1;
+	if (output_close(&ps->out))
+		ps->failed = 1;
+	free(ps->rows);
+	ps->rows = NULL;
+
+	return ps->failed;
+}
+
+int write_atlas(const struct bitmap *bp, const char *filename, int flags)
+{
+	struct png_stream ps;
+
+	if (png_stream_open(&ps, filename, bp->width, bp->height, bp->channels,
+			    flags))
+		return 1;
+	png_stream_rows(&ps, bp, 0, bp->height);
+	return png_stream_close(&ps);
+}
+
+/*
+ * Reads back an atlas png file written by write_atlas.
+ * Returns NULL if the file can't be read or is not a gray, gray and
+ * alpha or rgb image.
+ */
+struct bitmap *read_atlas(const char *filename)
+{
+	struct bitmap *volatile bp = NULL;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+	int color_type;
+	FILE *fp;
+	int y;
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return NULL;
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		goto failure;
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+		goto failure;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+		goto failure;
+
+	png_init_io(png_ptr, fp);
+	png_read_info(png_ptr, info_ptr);
+
+	color_type = png_get_color_type(png_ptr, info_ptr);
+	if ((color_type != PNG_COLOR_TYPE_GRAY &&
+	     color_type != PNG_COLOR_TYPE_GRAY_ALPHA &&
+	     color_type != PNG_COLOR_TYPE_RGB) ||
+	    png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE)
+		goto failure;
+	if (png_get_bit_depth(png_ptr, info_ptr) < 8)
+		png_set_expand_gray_1_2_4_to_8(png_ptr);
+	if (png_get_bit_depth(png_ptr, info_ptr) == 16)
+		png_set_strip_16(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
+	bp = create_bitmap(png_get_image_width(png_ptr, info_ptr),
+			   png_get_image_height(png_ptr, info_ptr),
+			   png_get_channels(png_ptr, info_ptr));
+	if (!bp)
+		goto failure;
+	for (y = 0; y < bp->height; y++)
+		png_read_row(png_ptr, bitmap_get_pixel(bp, 0, y), NULL);
+	png_read_end(png_ptr, NULL);
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fp);
+	return bp;
+
+failure:
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fp);
+	if (bp)
+		destroy_bitmap(bp);
+	return NULL;
+}
@@ -1,10 +1,23 @@
 #include "bitmap.h"
 
-void bitmap_alloc_pixels(struct bitmap *bitmap, int width, int height)
+/* Returns 0 or 1 if the pixels could not be allocated */
+int bitmap_alloc_channels(struct bitmap *bitmap, int width, int height,
+			  int channels)
 {
 	bitmap->width = width;
 	bitmap->height = height;
-	bitmap->pixels = calloc(sizeof(uint8_t), width * height);
+	bitmap->channels = channels;
+	bitmap->pixels = calloc(sizeof(uint8_t), width * height * channels);
+	bitmap->tile_size = 0;
+	bitmap->tiles = NULL;
+	bitmap->failed = 0;
+
+	return !bitmap->pixels && width && height;
+}
+
+int bitmap_alloc_pixels(struct bitmap *bitmap, int width, int height)
+{
+	return bitmap_alloc_channels(bitmap, width, height, 1);
 }
 
 void bitmap_free_pixels(struct bitmap *bitmap)
@@ -13,70 +26,278 @@ void bitmap_free_pixels(struct bitmap *bitmap)
 		free(bitmap->pixels);
 		bitmap->pixels = NULL;
 	}
+	if (bitmap->tiles) {
+		int i, count = bitmap_tile_count(bitmap, NULL);
+		for (i = 0; i < count; i++)
+			free(bitmap->tiles[i]);
+		free(bitmap->tiles);
+		bitmap->tiles = NULL;
+	}
 }
 
-struct bitmap *create_bitmap(int width, int height)
+/* Returns NULL when out of memory */
+struct bitmap *create_bitmap(int width, int height, int channels)
 {
 	struct bitmap *bitmap = malloc(sizeof(struct bitmap));
-	bitmap_alloc_pixels(bitmap, width, height);
+
+	if (bitmap && bitmap_alloc_channels(bitmap, width, height, channels)) {
+		free(bitmap);
+		bitmap = NULL;
+	}
 	return bitmap;
 }
 
+/* A tile_size of 0 gives a contiguous bitmap, NULL when out of memory */
+struct bitmap *create_tiled_bitmap(int width, int height, int tile_size,
+				   int channels)
+{
+	struct bitmap *bitmap;
+	int columns, rows;
+
+	if (!tile_size)
+		return create_bitmap(width, height, channels);
+
+	columns = (width + tile_size - 1) / tile_size;
+	rows = (height + tile_size - 1) / tile_size;
+
+	bitmap = malloc(sizeof(struct bitmap));
+	if (!bitmap)
+		return NULL;
+	bitmap->width = width;
+	bitmap->height = height;
+	bitmap->channels = channels;
+	bitmap->pixels = NULL;
+	bitmap->tile_size = tile_size;
+	bitmap->failed = 0;
+	bitmap->tiles = calloc(sizeof(uint8_t *), columns * rows);
+	if (!bitmap->tiles) {
+		free(bitmap);
+		bitmap = NULL;
+	}
+	return bitmap;
+}
+
+/* Returns the number of tiles and stores how many are allocated */
+int bitmap_tile_count(const struct bitmap *bitmap, int *allocated)
+{
+	int ts = bitmap->tile_size;
+	int i, count;
+
+	if (!ts)
+		return 0;
+
+	count = ((bitmap->width + ts - 1) / ts) * ((bitmap->height + ts - 1) / ts);
+	if (allocated) {
+		*allocated = 0;
+		for (i = 0; i < count; i++)
+			if (bitmap->tiles[i])
+				(*allocated)++;
+	}
+
+	return count;
+}
+
+/* Returns the tile holding the pixel, allocating it if asked to */
+static uint8_t *get_tile(const struct bitmap *bitmap, int x, int y, int alloc)
+{
+	int ts = bitmap->tile_size;
+	int columns = (bitmap->width + ts - 1) / ts;
+	uint8_t **tile = &bitmap->tiles[(y / ts) * columns + x / ts];
+
+	if (!*tile && alloc)
+		*tile = calloc(sizeof(uint8_t), ts * ts * bitmap->channels);
+
+	return *tile;
+}
+
 void destroy_bitmap(struct bitmap *bitmap)
 {
 	bitmap_free_pixels(bitmap);
 	free(bitmap);
 }
 
+/*
+ * Returns a pointer to a pixel. Pixels following it on the row are only
+ * contiguous up to the end of the tile for tiled bitmaps, whose tile is
+ * allocated on the way, NULL if it could not be.
+ */
 uint8_t *bitmap_get_pixel(const struct bitmap *bitmap, int x, int y)
 {
-	return bitmap->pixels + bitmap->width * y + x;
+	int ts = bitmap->tile_size;
+	uint8_t *tile;
+
+	if (ts) {
+		tile = get_tile(bitmap, x, y, 1);
+		if (!tile)
+			return NULL;
+		return tile + ((y % ts) * ts + x % ts) * bitmap->channels;
+	}
+
+	return bitmap->pixels + (bitmap->width * y + x) * bitmap->channels;
+}
+
+/*
+ * Blits a contiguous bitmap into a tiled one, one tile at a time so that
+ * every copy stays within a tile.
+ */
+static void blit_tiled(struct bitmap *bp, const struct bitmap *src, int x, int y)
+{
+	int ts = bp->tile_size;
+	int ch = bp->channels;
+	int tx, ty, row;
+
+	for (ty = y - y % ts; ty < y + src->height; ty += ts) {
+		int y0 = ty > y ? ty : y;
+		int y1 = ty + ts < y + src->height ? ty + ts : y + src->height;
+
+		for (tx = x - x % ts; tx < x + src->width; tx += ts) {
+			int x0 = tx > x ? tx : x;
+			int x1 = tx + ts < x + src->width ? tx + ts : x + src->width;
+			uint8_t *tile = get_tile(bp, tx, ty, 1);
+
+			if (!tile) {
+				bp->failed = 1;
+				continue;
+			}
+			for (row = y0; row < y1; row++)
+				memcpy(tile + ((row - ty) * ts + (x0 - tx)) * ch,
+				       &src->pixels[((row - y) * src->width + (x0 - x)) * ch],
+				       sizeof(uint8_t) * (x1 - x0) * ch);
+		}
+	}
 }
 
 void bitmap_blit(struct bitmap *bp, const struct bitmap *src, int x, int y)
 {
 	int row;
+
+	if (bp->tile_size) {
+		blit_tiled(bp, src, x, y);
+		return;
+	}
+
 	for (row = 0; row < src->height; ++row) {
-		memcpy(&bp->pixels[(y + row) * bp->width + x],
-		       &src->pixels[row * src->width],
-		       sizeof(uint8_t) * src->width);
+		memcpy(bitmap_get_pixel(bp, x, y + row),
+		       &src->pixels[row * src->width * src->channels],
+		       sizeof(uint8_t) * src->width * src->channels);
 	}
 }
 
-static inline uint8_t get_pixel_value(const FT_Bitmap *ft_bitmap, int x, int y)
+/* Returns whether two contiguous bitmaps have the same size and pixels */
+int bitmap_equal(const struct bitmap *a, const struct bitmap *b)
 {
-	uint8_t byte = ft_bitmap->buffer[(ft_bitmap->pitch * y) + (x / 8)];
-	uint8_t bit_mask = 0x80 >> (x % 8);
-	return (byte & bit_mask) ? 255 : 0;
+	return a->width == b->width && a->height == b->height &&
+	       a->channels == b->channels &&
+	       !memcmp(a->pixels, b->pixels,
+		       (size_t)a->width * a->height * a->channels);
+}
+
+/*
+ * Blits a contiguous single channel bitmap keeping the largest value of
+ * each pixel, so that overlapping coverages or distance fields merge
+ * into their union.
+ */
+void bitmap_blit_max(struct bitmap *bp, const struct bitmap *src, int x, int y)
+{
+	int row, col;
+
+	for (row = 0; row < src->height; row++) {
+		const uint8_t *s = &src->pixels[row * src->width];
+		for (col = 0; col < src->width; col++) {
+			uint8_t *d = bitmap_get_pixel(bp, x + col, y + row);
+			if (!d) {
+				bp->failed = 1;
+				continue;
+			}
+			if (s[col] > *d)
+				*d = s[col];
+		}
+	}
+}
+
+/*
+ * Copies the rows y0 to y1 (excluded) into dst as contiguous rows. Tiled
+ * bitmaps are read one tile at a time, missing tiles giving zeros.
+ */
+void bitmap_copy_rows(const struct bitmap *bitmap, int y0, int y1, uint8_t *dst)
+{
+	int ts = bitmap->tile_size;
+	int ch = bitmap->channels;
+	int width = bitmap->width;
+	int tx, ty, row;
+
+	if (!ts) {
+		memcpy(dst, bitmap->pixels + width * y0 * ch,
+		       sizeof(uint8_t) * width * (y1 - y0) * ch);
+		return;
+	}
+
+	for (ty = y0 - y0 % ts; ty < y1; ty += ts) {
+		int r0 = ty > y0 ? ty : y0;
+		int r1 = ty + ts < y1 ? ty + ts : y1;
+
+		for (tx = 0; tx < width; tx += ts) {
+			int w = tx + ts < width ? ts : width - tx;
+			const uint8_t *tile = get_tile(bitmap, tx, ty, 0);
+
+			for (row = r0; row < r1; row++) {
+				uint8_t *d = dst + ((row - y0) * width + tx) * ch;
+				if (tile)
+					memcpy(d, tile + (row - ty) * ts * ch, w * ch);
+				else
+					memset(d, 0, w * ch);
+			}
+		}
+	}
+}
+
+/* Returns the 8 bits coverage of a pixel of a row of a FreeType bitmap */
+static inline uint8_t get_pixel_value(const FT_Bitmap *ft_bitmap,
+				      const uint8_t *row, int x)
+{
+	switch (ft_bitmap->pixel_mode) {
+	case FT_PIXEL_MODE_MONO:
+		return (row[x / 8] & (0x80 >> (x % 8))) ? 255 : 0;
+	case FT_PIXEL_MODE_GRAY2:
+		return ((row[x / 4] >> (6 - 2 * (x % 4))) & 0x03) * 85;
+	case FT_PIXEL_MODE_GRAY4:
+		return ((row[x / 2] >> (4 - 4 * (x % 2))) & 0x0F) * 17;
+	case FT_PIXEL_MODE_BGRA:
+		/* Color bitmaps only contribute their coverage */
+		return row[x * 4 + 3];
+	default:
+		return row[x];
+	}
 }
 
 void bitmap_blit_ft_bitmap(struct bitmap *bitmap, const FT_Bitmap *ft_bitmap,
 			   int x, int y)
 {
-	unsigned int row;
+	int row;
 	int width = ft_bitmap->width;
 	int height = ft_bitmap->rows;
 
 	if ((x + width) > bitmap->width || (y + height) > bitmap->height)
 		return;
 
-	switch (ft_bitmap->pixel_mode) {
-	case FT_PIXEL_MODE_GRAY:
-		for (row = 0; row < ft_bitmap->rows; ++row, ++y) {
-			memcpy(bitmap_get_pixel(bitmap, x, y),
-			       &ft_bitmap->buffer[row * width],
+	for (row = 0; row < height; ++row, ++y) {
+		const uint8_t *src = ft_bitmap->buffer + row * ft_bitmap->pitch;
+		int i;
+
+		if (ft_bitmap->pixel_mode == FT_PIXEL_MODE_GRAY &&
+		    !bitmap->tile_size && bitmap->channels == 1) {
+			memcpy(bitmap_get_pixel(bitmap, x, y), src,
 			       sizeof(uint8_t) * width);
+			continue;
 		}
-		break;
-	case FT_PIXEL_MODE_MONO:
-		printf("pitch: %d\n", ft_bitmap->pitch);
-		for (row = 0; row < height; ++row, ++y) {
-			int i;
-			for (i = 0; i < width; ++i) {
-				uint8_t *pixel = bitmap_get_pixel(bitmap, i, y);
-				*pixel = get_pixel_value(ft_bitmap, i, y);
+
+		for (i = 0; i < width; ++i) {
+			uint8_t *pixel = bitmap_get_pixel(bitmap, x + i, y);
+			if (!pixel) {
+				bitmap->failed = 1;
+				continue;
 			}
+			*pixel = get_pixel_value(ft_bitmap, src, i);
 		}
-		break;
 	}
 }
@@ -5,18 +5,36 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+/*
+ * A bitmap is either stored as contiguous rows of pixels, or as square
+ * tiles of tile_size pixels allocated on first write so that memory only
+ * grows with the area actually drawn. Pixels have interleaved channels,
+ * the first one being the coverage.
+ */
 struct bitmap {
 	int width;
 	int height;
+	int channels; /* bytes per pixel */
 	uint8_t *pixels;
+	int tile_size; /* 0 for contiguous rows */
+	uint8_t **tiles; /* row-major, NULL until written */
+	int failed; /* a tile could not be allocated, its pixels are lost */
 };
 
-void bitmap_alloc_pixels(struct bitmap *bitmap, int width, int height);
+int bitmap_alloc_pixels(struct bitmap *bitmap, int width, int height);
+int bitmap_alloc_channels(struct bitmap *bitmap, int width, int height,
+			  int channels);
 void bitmap_free_pixels(struct bitmap *bitmap);
-struct bitmap *create_bitmap(int width, int height);
+struct bitmap *create_bitmap(int width, int height, int channels);
+struct bitmap *create_tiled_bitmap(int width, int height, int tile_size,
+				   int channels);
+int bitmap_tile_count(const struct bitmap *bitmap, int *allocated);
+void bitmap_copy_rows(const struct bitmap *bitmap, int y0, int y1, uint8_t *dst);
 void destroy_bitmap(struct bitmap *bitmap);
 uint8_t *bitmap_get_pixel(const struct bitmap *bitmap, int x, int y);
+int bitmap_equal(const struct bitmap *a, const struct bitmap *b);
 void bitmap_blit(struct bitmap *bp, const struct bitmap *src, int x, int y);
+void bitmap_blit_max(struct bitmap *bp, const struct bitmap *src, int x, int y);
 void bitmap_blit_ft_bitmap(struct bitmap *bp, const FT_Bitmap *ftbp, int x, int y);
 
 #endif /* BITMAP_H */
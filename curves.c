@@ -0,0 +1,634 @@
+#include "fr.h"
+#include "raster_font.h"
+#include "error.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+
+/*
+ * Curve export: glyph outlines are loaded unscaled, converted to
+ * quadratic Bézier curves in em units, cubic segments being split until
+ * a quadratic is close enough, and lines becoming flat quadratics. Each
+ * glyph's curves are quantized over its box and indexed by bands so
+ * that a shader only tests the few curves crossing the band of a pixel.
+ */
+
+#define CURVE_BANDS 8
+
+/* Largest distance between a cubic and its quadratics, in em */
+#define CUBIC_TOLERANCE (1.0 / 1024.0)
+#define CUBIC_MAX_DEPTH 8
+
+#define QUANT_MAX 65535.0
+
+/* Quadratic curve in em units */
+struct quad {
+	double p[3][2];
+};
+
+/* Outline of the glyph being converted */
+struct outline_builder {
+	struct quad *quads;
+	int count;
+	int capacity;
+	double pen[2];
+	double scale; /* em per font unit */
+};
+
+/* Every exported glyph, laid out as in the file */
+struct curve_set {
+	uint32_t *runes;
+	struct curve_glyph_def *glyphs;
+	int num_glyphs;
+	int glyphs_capacity;
+	struct curve_def *curves;
+	int num_curves;
+	int curves_capacity;
+	struct curve_band *bands; /* 2 * CURVE_BANDS per glyph */
+	uint16_t *indices;
+	int num_indices;
+	int indices_capacity;
+};
+
+static void *grow(void *array, int *capacity, int count, size_t size)
+{
+	if (count < *capacity)
+		return array;
+
+	*capacity = *capacity ? *capacity * 2 : 64;
+	array = realloc(array, size * *capacity);
+	if (!array)
+		die("out of memory");
+
+	return array;
+}
+
+static void add_quad(struct outline_builder *ob, double x0, double y0,
+		     double x1, double y1, double x2, double y2)
+{
+	struct quad *q;
+
+	ob->quads = grow(ob->quads, &ob->capacity, ob->count, sizeof(*q));
+	q = &ob->quads[ob->count++];
+	q->p[0][0] = x0;
+	q->p[0][1] = y0;
+	q->p[1][0] = x1;
+	q->p[1][1] = y1;
+	q->p[2][0] = x2;
+	q->p[2][1] = y2;
+}
+
+/*
+ * Approximates a cubic with the quadratic sharing its end points whose
+ * control point is the average of the two tangent intersections, and
+ * splits it in halves while that quadratic is too far off.
+ */
+static void add_cubic(struct outline_builder *ob, const double p[4][2],
+		      int depth)
+{
+	double dx = p[3][0] - 3.0 * p[2][0] + 3.0 * p[1][0] - p[0][0];
+	double dy = p[3][1] - 3.0 * p[2][1] + 3.0 * p[1][1] - p[0][1];
+	double left[4][2], right[4][2];
+	int i;
+
+	if (depth == CUBIC_MAX_DEPTH ||
+	    sqrt(3.0) / 36.0 * sqrt(dx * dx + dy * dy) <= CUBIC_TOLERANCE) {
+		add_quad(ob, p[0][0], p[0][1],
+			 (3.0 * (p[1][0] + p[2][0]) - p[0][0] - p[3][0]) / 4.0,
+			 (3.0 * (p[1][1] + p[2][1]) - p[0][1] - p[3][1]) / 4.0,
+			 p[3][0], p[3][1]);
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		double p01 = (p[0][i] + p[1][i]) / 2.0;
+		double p12 = (p[1][i] + p[2][i]) / 2.0;
+		double p23 = (p[2][i] + p[3][i]) / 2.0;
+		double p012 = (p01 + p12) / 2.0;
+		double p123 = (p12 + p23) / 2.0;
+
+		left[0][i] = p[0][i];
+		left[1][i] = p01;
+		left[2][i] = p012;
+		left[3][i] = right[0][i] = (p012 + p123) / 2.0;
+		right[1][i] = p123;
+		right[2][i] = p23;
+		right[3][i] = p[3][i];
+	}
+	add_cubic(ob, left, depth + 1);
+	add_cubic(ob, right, depth + 1);
+}
+
+static int move_to(const FT_Vector *to, void *data)
+{
+	struct outline_builder *ob = data;
+
+	ob->pen[0] = to->x * ob->scale;
+	ob->pen[1] = to->y * ob->scale;
+	return 0;
+}
+
+static int line_to(const FT_Vector *to, void *data)
+{
+	struct outline_builder *ob = data;
+	double x = to->x * ob->scale;
+	double y = to->y * ob->scale;
+
+	if (x != ob->pen[0] || y != ob->pen[1])
+		add_quad(ob, ob->pen[0], ob->pen[1], (ob->pen[0] + x) / 2.0,
+			 (ob->pen[1] + y) / 2.0, x, y);
+	ob->pen[0] = x;
+	ob->pen[1] = y;
+	return 0;
+}
+
+static int conic_to(const FT_Vector *control, const FT_Vector *to, void *data)
+{
+	struct outline_builder *ob = data;
+	double x = to->x * ob->scale;
+	double y = to->y * ob->scale;
+
+	add_quad(ob, ob->pen[0], ob->pen[1], control->x * ob->scale,
+		 control->y * ob->scale, x, y);
+	ob->pen[0] = x;
+	ob->pen[1] = y;
+	return 0;
+}
+
+static int cubic_to(const FT_Vector *control1, const FT_Vector *control2,
+		    const FT_Vector *to, void *data)
+{
+	struct outline_builder *ob = data;
+	double p[4][2] = {
+		{ ob->pen[0], ob->pen[1] },
+		{ control1->x * ob->scale, control1->y * ob->scale },
+		{ control2->x * ob->scale, control2->y * ob->scale },
+		{ to->x * ob->scale, to->y * ob->scale },
+	};
+
+	add_cubic(ob, p, 0);
+	ob->pen[0] = p[3][0];
+	ob->pen[1] = p[3][1];
+	return 0;
+}
+
+static const FT_Outline_Funcs outline_funcs = {
+	.move_to = move_to,
+	.line_to = line_to,
+	.conic_to = conic_to,
+	.cubic_to = cubic_to,
+	.shift = 0,
+	.delta = 0,
+};
+
+static uint16_t quantize(double v, double lo, double hi)
+{
+	if (hi <= lo)
+		return 0;
+	return (uint16_t)floor((v - lo) / (hi - lo) * QUANT_MAX + 0.5);
+}
+
+/* Returns a control point coordinate of a curve, in em */
+static double curve_point(const struct curve_glyph_def *glyph,
+			  const struct curve_def *curve, int i, int axis)
+{
+	double lo = glyph->bbox[axis];
+	double hi = glyph->bbox[axis + 2];
+
+	return lo + curve->p[i][axis] / QUANT_MAX * (hi - lo);
+}
+
+static int curve_min(const struct curve_def *curve, int axis)
+{
+	int m = curve->p[0][axis];
+
+	if (curve->p[1][axis] < m)
+		m = curve->p[1][axis];
+	if (curve->p[2][axis] < m)
+		m = curve->p[2][axis];
+	return m;
+}
+
+static int curve_max(const struct curve_def *curve, int axis)
+{
+	int m = curve->p[0][axis];
+
+	if (curve->p[1][axis] > m)
+		m = curve->p[1][axis];
+	if (curve->p[2][axis] > m)
+		m = curve->p[2][axis];
+	return m;
+}
+
+/* Curves of the glyph being banded, and the axis to sort them along */
+static const struct curve_def *sort_curves;
+static int sort_axis;
+
+static int compare_extents(const void *a, const void *b)
+{
+	int ma = curve_max(&sort_curves[*(const uint16_t *)a], sort_axis);
+	int mb = curve_max(&sort_curves[*(const uint16_t *)b], sort_axis);
+
+	return (mb > ma) - (mb < ma);
+}
+
+/*
+ * Fills the bands of a glyph. A horizontal band lists the curves whose
+ * vertical extent overlaps it, flat horizontal curves excepted as no
+ * horizontal ray crosses them, and conversely for vertical bands.
+ */
+static void build_bands(struct curve_set *set, int g)
+{
+	const struct curve_glyph_def *glyph = &set->glyphs[g];
+	const struct curve_def *curves = &set->curves[glyph->curve_first];
+	struct curve_band *bands = &set->bands[g * 2 * CURVE_BANDS];
+	int axis, b, i;
+
+	for (axis = 0; axis < 2; axis++) {
+		/* Horizontal bands split the box along y. */
+		int across = 1 - axis;
+
+		for (b = 0; b < CURVE_BANDS; b++) {
+			struct curve_band *band = &bands[axis * CURVE_BANDS + b];
+			double lo = b * QUANT_MAX / CURVE_BANDS;
+			double hi = (b + 1) * QUANT_MAX / CURVE_BANDS;
+
+			band->index_first = set->num_indices;
+			band->index_count = 0;
+			for (i = 0; i < glyph->curve_count; i++) {
+				int cmin = curve_min(&curves[i], across);
+				int cmax = curve_max(&curves[i], across);
+				if (cmin == cmax || cmax < lo || cmin > hi)
+					continue;
+
+				set->indices = grow(set->indices, &set->indices_capacity,
+						    set->num_indices, sizeof(uint16_t));
+				set->indices[set->num_indices++] = i;
+				band->index_count++;
+			}
+
+			sort_curves = curves;
+			sort_axis = axis;
+			qsort(&set->indices[band->index_first], band->index_count,
+			      sizeof(uint16_t), compare_extents);
+		}
+	}
+}
+
+/*
+ * Adds the glyph of a rune to the set. Returns 0 or 1 if the rune has
+ * no glyph or its outline can't be read.
+ */
+static int add_rune(struct curve_set *set, FT_Face *faces, int num_faces,
+		    uint32_t rune, struct outline_builder *ob)
+{
+	struct curve_glyph_def *glyph;
+	FT_UInt glyph_index;
+	FT_Face face;
+	int face_index;
+	double bbox[4];
+	int i, j;
+
+	face_index = resolve_rune(faces, num_faces, rune, &glyph_index);
+	if (face_index < 0) {
+		warning("skipping rune U+%04X (glyph unavailable)", rune);
+		return 1;
+	}
+
+	face = faces[face_index];
+	if (FT_Load_Glyph(face, glyph_index, FT_LOAD_NO_SCALE |
+			  FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP) ||
+	    face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
+		warning("skipping rune U+%04X (no outline)", rune);
+		return 1;
+	}
+
+	ob->count = 0;
+	ob->scale = 1.0 / face->units_per_EM;
+	if (FT_Outline_Decompose(&face->glyph->outline, &outline_funcs, ob)) {
+		warning("skipping rune U+%04X (invalid outline)", rune);
+		return 1;
+	}
+	if (ob->count > UINT16_MAX + 1) {
+		warning("skipping rune U+%04X (too many curves)", rune);
+		return 1;
+	}
+
+	bbox[0] = bbox[1] = ob->count ? HUGE_VAL : 0.0;
+	bbox[2] = bbox[3] = ob->count ? -HUGE_VAL : 0.0;
+	for (i = 0; i < ob->count; i++) {
+		for (j = 0; j < 3; j++) {
+			const double *p = ob->quads[i].p[j];
+			bbox[0] = p[0] < bbox[0] ? p[0] : bbox[0];
+			bbox[1] = p[1] < bbox[1] ? p[1] : bbox[1];
+			bbox[2] = p[0] > bbox[2] ? p[0] : bbox[2];
+			bbox[3] = p[1] > bbox[3] ? p[1] : bbox[3];
+		}
+	}
+
+	set->runes = grow(set->runes, &set->glyphs_capacity, set->num_glyphs,
+			  sizeof(uint32_t));
+	set->glyphs = realloc(set->glyphs, sizeof(*set->glyphs) *
+			      set->glyphs_capacity);
+	set->bands = realloc(set->bands, sizeof(*set->bands) * 2 * CURVE_BANDS *
+			     set->glyphs_capacity);
+	if (!set->glyphs || !set->bands)
+		die("out of memory");
+
+	set->runes[set->num_glyphs] = rune;
+	glyph = &set->glyphs[set->num_glyphs];
+	memset(glyph, 0, sizeof(*glyph));
+	for (i = 0; i < 4; i++)
+		glyph->bbox[i] = bbox[i];
+	glyph->advance[0] = face->glyph->metrics.horiAdvance * ob->scale;
+	glyph->advance[1] = face->glyph->metrics.vertAdvance * ob->scale;
+	glyph->curve_first = set->num_curves;
+	glyph->curve_count = ob->count;
+	glyph->face = face_index;
+
+	/* Quantize over the box as stored, so that decoding matches. */
+	for (i = 0; i < ob->count; i++) {
+		struct curve_def *curve;
+		set->curves = grow(set->curves, &set->curves_capacity,
+				   set->num_curves, sizeof(*curve));
+		curve = &set->curves[set->num_curves++];
+		for (j = 0; j < 3; j++) {
+			curve->p[j][0] = quantize(ob->quads[i].p[j][0],
+						  glyph->bbox[0], glyph->bbox[2]);
+			curve->p[j][1] = quantize(ob->quads[i].p[j][1],
+						  glyph->bbox[1], glyph->bbox[3]);
+		}
+	}
+
+	build_bands(set, set->num_glyphs++);
+	return 0;
+}
+
+/*
+ * Adds the signed coverage of the crossings of a curve with the ray
+ * cast from (x, y) towards increasing x along axis 0, or increasing y
+ * along axis 1. Crossings within half a pixel of the sample are counted
+ * in proportion of their distance. Each curve is split at its extremum
+ * into monotonic halves, which cross the ray line when it lies between
+ * their ends, bottom end included, so that a ray through the point
+ * joining two curves counts it once.
+ */
+static double ray_coverage(const struct curve_glyph_def *glyph,
+			   const struct curve_def *curve, int axis,
+			   double x, double y, double pixel)
+{
+	int across = 1 - axis;
+	double along = axis ? y : x;
+	double level = axis ? x : y;
+	double a0 = curve_point(glyph, curve, 0, axis);
+	double a1 = curve_point(glyph, curve, 1, axis);
+	double a2 = curve_point(glyph, curve, 2, axis);
+	double c0 = curve_point(glyph, curve, 0, across);
+	double c1 = curve_point(glyph, curve, 1, across);
+	double c2 = curve_point(glyph, curve, 2, across);
+	double a = c0 - 2.0 * c1 + c2;
+	double b = 2.0 * (c1 - c0);
+	double splits[3] = { 0.0, 1.0, 1.0 };
+	double coverage = 0.0;
+	int n = 2, i;
+
+	if (a != 0.0 && -b / (2.0 * a) > 0.0 && -b / (2.0 * a) < 1.0) {
+		splits[1] = -b / (2.0 * a);
+		n = 3;
+	}
+
+	for (i = 0; i + 1 < n; i++) {
+		double t0 = splits[i], t1 = splits[i + 1];
+		double v0 = (a * t0 + b) * t0 + c0;
+		double v1 = (a * t1 + b) * t1 + c0;
+		double lo = v0 < v1 ? v0 : v1;
+		double hi = v0 < v1 ? v1 : v0;
+		double t, d, s;
+
+		if (level < lo || level >= hi)
+			continue;
+
+		/* Root of a t^2 + b t + c0 - level within [t0, t1] */
+		if (fabs(a) < 1e-12) {
+			t = (level - c0) / b;
+		} else {
+			d = sqrt(fmax(b * b - 4.0 * a * (c0 - level), 0.0));
+			t = (-b - d) / (2.0 * a);
+			if (t < t0 - 1e-9 || t > t1 + 1e-9)
+				t = (-b + d) / (2.0 * a);
+		}
+		t = t < t0 ? t0 : (t > t1 ? t1 : t);
+
+		s = ((1.0 - t) * (1.0 - t) * a0 + 2.0 * t * (1.0 - t) * a1 +
+		     t * t * a2 - along) / pixel + 0.5;
+		s = s < 0.0 ? 0.0 : (s > 1.0 ? 1.0 : s);
+		coverage += v1 > v0 ? s : -s;
+	}
+
+	return coverage;
+}
+
+/*
+ * Reference coverage of the pixel centered on (x, y), in em, as a
+ * shader would compute it from the exported data: the average of the
+ * coverages along a horizontal and a vertical ray, each testing only the
+ * curves of the band holding the pixel center.
+ */
+static double curve_coverage(const struct curve_set *set, int g,
+			     double x, double y, double pixel)
+{
+	const struct curve_glyph_def *glyph = &set->glyphs[g];
+	const struct curve_def *curves = &set->curves[glyph->curve_first];
+	const struct curve_band *bands = &set->bands[g * 2 * CURVE_BANDS];
+	double coverage[2] = { 0.0, 0.0 };
+	int axis, b, i;
+
+	for (axis = 0; axis < 2; axis++) {
+		int across = 1 - axis;
+		double along = axis ? y : x;
+		double lo = glyph->bbox[across];
+		double hi = glyph->bbox[across + 2];
+		double level = axis ? x : y;
+
+		if (hi <= lo || level < lo || level > hi)
+			continue;
+		b = (level - lo) / (hi - lo) * CURVE_BANDS;
+		if (b == CURVE_BANDS)
+			b--;
+
+		const struct curve_band *band = &bands[axis * CURVE_BANDS + b];
+		for (i = 0; i < band->index_count; i++) {
+			const struct curve_def *curve;
+			curve = &curves[set->indices[band->index_first + i]];
+
+			/* Curves are sorted, the others are all behind. */
+			if (glyph->bbox[axis] + curve_max(curve, axis) / QUANT_MAX *
+			    (glyph->bbox[axis + 2] - glyph->bbox[axis]) <
+			    along - pixel / 2.0)
+				break;
+			coverage[axis] += ray_coverage(glyph, curve, axis, x, y,
+						       pixel);
+		}
+	}
+
+	coverage[0] = fmin(fabs(coverage[0]), 1.0);
+	coverage[1] = fmin(fabs(coverage[1]), 1.0);
+	return (coverage[0] + coverage[1]) / 2.0;
+}
+
+/*
+ * Compares the reference coverage of every exported glyph with the
+ * unhinted rendering of FreeType at each render size.
+ */
+static void check_curves(const struct curve_set *set, FT_Face *faces,
+			 const struct fr *fr)
+{
+	int g, k, x, y;
+
+	for (k = 0; k < fr->num_sizes; k++) {
+		int size = fr->pixel_heights[k];
+		double pixel = 1.0 / size;
+		double total = 0.0, worst = 0.0;
+		long num_pixels = 0;
+		int i;
+
+		for (i = 0; i < fr->num_faces; i++)
+			if (FT_Set_Pixel_Sizes(faces[i], 0, size))
+				die("unable to set font size %d", size);
+
+		for (g = 0; g < set->num_glyphs; g++) {
+			FT_Face face = faces[set->glyphs[g].face];
+			FT_UInt glyph_index = FT_Get_Char_Index(face, set->runes[g]);
+			double glyph_worst = 0.0;
+			FT_GlyphSlot slot;
+
+			if (FT_Load_Glyph(face, glyph_index, FT_LOAD_NO_HINTING |
+					  FT_LOAD_NO_BITMAP) ||
+			    FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL))
+				continue;
+
+			slot = face->glyph;
+			for (y = 0; y < slot->bitmap.rows; y++) {
+				for (x = 0; x < slot->bitmap.width; x++) {
+					uint8_t value = slot->bitmap.buffer[y * slot->bitmap.pitch + x];
+					double cx = (slot->bitmap_left + x + 0.5) * pixel;
+					double cy = (slot->bitmap_top - y - 0.5) * pixel;
+					double diff = fabs(curve_coverage(set, g, cx, cy, pixel) -
+							   value / 255.0);
+
+					total += diff;
+					num_pixels++;
+					if (diff > glyph_worst)
+						glyph_worst = diff;
+				}
+			}
+			if (glyph_worst > worst)
+				worst = glyph_worst;
+			if (fr->option_verbose > 1)
+				printf("rune U+%04X at %dpx: %d curves, coverage error %.3f\n",
+				       set->runes[g], size, set->glyphs[g].curve_count,
+				       glyph_worst);
+		}
+
+		printf("%dpx: coverage error against FreeType %.4f mean, %.3f max\n",
+		       size, num_pixels ? total / num_pixels : 0.0, worst);
+	}
+}
+
+static int write_curves(const struct curve_set *set, const char *path,
+			float space_advance, float height, int flags)
+{
+	struct curves_hdr hdr;
+	struct output out;
+
+	if (output_open(&out, path, flags)) {
+		error("opening %s", path);
+		return 1;
+	}
+
+	hdr.glyph_count = set->num_glyphs;
+	hdr.curve_count = set->num_curves;
+	hdr.index_count = set->num_indices;
+	hdr.band_count = CURVE_BANDS;
+	hdr.lut_offset = sizeof(hdr);
+	hdr.glyph_offset = hdr.lut_offset + sizeof(uint32_t) * set->num_glyphs;
+	hdr.curve_offset = hdr.glyph_offset +
+			   sizeof(struct curve_glyph_def) * set->num_glyphs;
+	hdr.band_offset = hdr.curve_offset +
+			  sizeof(struct curve_def) * set->num_curves;
+	hdr.index_offset = hdr.band_offset + sizeof(struct curve_band) *
+			   2 * CURVE_BANDS * set->num_glyphs;
+	hdr.space_advance = space_advance;
+	hdr.height = height;
+
+	output_write(&out, &hdr, sizeof(hdr));
+	output_write(&out, set->runes, sizeof(uint32_t) * set->num_glyphs);
+	output_write(&out, set->glyphs,
+		     sizeof(struct curve_glyph_def) * set->num_glyphs);
+	output_write(&out, set->curves, sizeof(struct curve_def) * set->num_curves);
+	output_write(&out, set->bands, sizeof(struct curve_band) *
+		     2 * CURVE_BANDS * set->num_glyphs);
+	output_write(&out, set->indices, sizeof(uint16_t) * set->num_indices);
+
+	if (output_close(&out)) {
+		error("writing %s", path);
+		return 1;
+	}
+	return 0;
+}
+
+void export_curves(FT_Face *faces, int num_faces, const struct fr *fr)
+{
+	struct outline_builder ob;
+	struct curve_set set;
+	const range_t *range;
+	float space_advance = 0.0f;
+	FT_UInt glyph_index;
+	FT_Face face = faces[0];
+	uint32_t i;
+
+	memset(&ob, 0, sizeof(ob));
+	memset(&set, 0, sizeof(set));
+
+	for (range = fr->ranges; range; range = range->next)
+		for (i = range->lo; i <= range->hi; i++)
+			add_rune(&set, faces, num_faces, i, &ob);
+
+	glyph_index = FT_Get_Char_Index(face, ' ');
+	if (FT_Load_Glyph(face, glyph_index, FT_LOAD_NO_SCALE))
+		warning("unaible to retrieve horizontal space advance");
+	else
+		space_advance = (float)face->glyph->metrics.horiAdvance /
+				face->units_per_EM;
+
+	write_curves(&set, fr->curves_filename, space_advance,
+		     (float)face->height / face->units_per_EM, output_flags(fr));
+
+	if (fr->option_verbose) {
+		long band_curves = 0;
+		int b;
+
+		for (b = 0; b < 2 * CURVE_BANDS * set.num_glyphs; b++)
+			band_curves += set.bands[b].index_count;
+		printf("%d glyphs exported to %s: %d curves, %.1f per glyph, "
+		       "%.1f per band\n", set.num_glyphs, fr->curves_filename,
+		       set.num_curves,
+		       set.num_glyphs ? (double)set.num_curves / set.num_glyphs : 0.0,
+		       set.num_glyphs ? (double)band_curves /
+		       (2 * CURVE_BANDS * set.num_glyphs) : 0.0);
+		check_curves(&set, faces, fr);
+		printf("Done.\n");
+	}
+
+	free(ob.quads);
+	free(set.runes);
+	free(set.glyphs);
+	free(set.curves);
+	free(set.bands);
+	free(set.indices);
+}
@@ -0,0 +1,179 @@
+#include "fr.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Effects are baked into extra channels of every glyph, computed from
+ * its coverage so that styled text is drawn with a single texture fetch:
+ * - the outline is the coverage dilated by a disk of the outline radius;
+ * - the shadow is the coverage blurred by a gaussian and moved by the
+ *   shadow offset.
+ * Glyph boxes grow by a margin holding the effects, the coverage being
+ * zero around the glyph.
+ */
+
+/* Returns 0 or 1 when out of memory */
+int effects_init(struct effects *e, const struct fr *fr)
+{
+	int i, offset;
+	float sum;
+
+	memset(e, 0, sizeof(*e));
+	e->outline = fr->outline;
+	e->shadow = fr->shadow;
+	e->shadow_offset[0] = fr->shadow_offset[0];
+	e->shadow_offset[1] = fr->shadow_offset[1];
+	e->channels = 1 + (e->outline > 0) + (e->shadow > 0.0f);
+	e->margin = e->outline;
+
+	if (e->shadow <= 0.0f)
+		return 0;
+
+	/* Three deviations hold all but a thousandth of the weight. */
+	e->shadow_radius = (int)ceilf(3.0f * e->shadow);
+	e->kernel = malloc(sizeof(float) * (2 * e->shadow_radius + 1));
+	if (!e->kernel)
+		return 1;
+	sum = 0.0f;
+	for (i = -e->shadow_radius; i <= e->shadow_radius; i++) {
+		e->kernel[i + e->shadow_radius] =
+			expf(-(float)(i * i) / (2.0f * e->shadow * e->shadow));
+		sum += e->kernel[i + e->shadow_radius];
+	}
+	for (i = 0; i < 2 * e->shadow_radius + 1; i++)
+		e->kernel[i] /= sum;
+
+	offset = abs(e->shadow_offset[0]) > abs(e->shadow_offset[1]) ?
+		 abs(e->shadow_offset[0]) : abs(e->shadow_offset[1]);
+	if (e->shadow_radius + offset > e->margin)
+		e->margin = e->shadow_radius + offset;
+
+	return 0;
+}
+
+void effects_done(struct effects *e)
+{
+	free(e->kernel);
+	e->kernel = NULL;
+}
+
+/* Sets channel c to the coverage dilated by a disk of the radius */
+static void dilate(struct bitmap *bp, int c, int radius)
+{
+	int ch = bp->channels;
+	int x, y, dx, dy;
+
+	for (y = 0; y < bp->height; y++) {
+		for (x = 0; x < bp->width; x++) {
+			uint8_t v = 0;
+
+			for (dy = -radius; dy <= radius; dy++) {
+				if (y + dy < 0 || y + dy >= bp->height)
+					continue;
+				const uint8_t *row = &bp->pixels[(y + dy) * bp->width * ch];
+				for (dx = -radius; dx <= radius; dx++) {
+					/* Rounded so that radius r spans 2r+1 pixels */
+					if (dx * dx + dy * dy > radius * radius + radius ||
+					    x + dx < 0 || x + dx >= bp->width)
+						continue;
+					if (row[(x + dx) * ch] > v)
+						v = row[(x + dx) * ch];
+				}
+			}
+			bp->pixels[(y * bp->width + x) * ch + c] = v;
+		}
+	}
+}
+
+/* Adds k times s to d, a loop the compiler turns into vector code */
+static void scale_add(float *restrict d, const float *restrict s, float k,
+		      int n)
+{
+	int x;
+
+	for (x = 0; x < n; x++)
+		d[x] += k * s[x];
+}
+
+/*
+ * Sets channel c to the coverage blurred and moved by the shadow. Rows
+ * and columns are convolved in turn, each tap scaling a whole row of a
+ * zero padded copy so that inner loops run over contiguous floats.
+ * Returns 0 or 1 when out of memory.
+ */
+static int blur(struct bitmap *bp, int c, const struct effects *e)
+{
+	int r = e->shadow_radius;
+	int w = bp->width, h = bp->height, ch = bp->channels;
+	int pw = w + 2 * r;
+	float *src = calloc((size_t)pw * (h + 2 * r), sizeof(float));
+	float *tmp = calloc((size_t)w * (h + 2 * r), sizeof(float));
+	float *out = calloc((size_t)w * h, sizeof(float));
+	int x, y, i;
+
+	if (!src || !tmp || !out) {
+		free(src);
+		free(tmp);
+		free(out);
+		return 1;
+	}
+
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			src[(y + r) * pw + x + r] = bp->pixels[(y * w + x) * ch];
+
+	/* Horizontal pass, rows of tmp keep the vertical padding */
+	for (y = 0; y < h; y++) {
+		const float *s = &src[(y + r) * pw];
+		float *d = &tmp[(y + r) * w];
+
+		for (i = 0; i <= 2 * r; i++)
+			scale_add(d, s + i, e->kernel[i], w);
+	}
+
+	/* Vertical pass */
+	for (y = 0; y < h; y++) {
+		float *d = &out[y * w];
+
+		for (i = 0; i <= 2 * r; i++)
+			scale_add(d, &tmp[(y + i) * w], e->kernel[i], w);
+	}
+
+	for (y = 0; y < h; y++) {
+		int sy = y - e->shadow_offset[1];
+
+		for (x = 0; x < w; x++) {
+			int sx = x - e->shadow_offset[0];
+			float v = 0.0f;
+
+			if (sx >= 0 && sx < w && sy >= 0 && sy < h)
+				v = out[sy * w + sx];
+			bp->pixels[(y * w + x) * ch + c] = v >= 255.0f ? 255 :
+							   (uint8_t)(v + 0.5f);
+		}
+	}
+
+	free(src);
+	free(tmp);
+	free(out);
+
+	return 0;
+}
+
+/*
+ * Fills the effect channels of a glyph bitmap from its coverage.
+ * Returns 0 or 1 when out of memory.
+ */
+int apply_effects(const struct effects *e, struct bitmap *bp)
+{
+	int c = 1;
+
+	if (e->outline)
+		dilate(bp, c++, e->outline);
+	if (e->shadow > 0.0f)
+		return blur(bp, c++, e);
+
+	return 0;
+}
@@ -3,55 +3,23 @@
 #include "raster_font.h"
 #include "error.h"
 
-#include <png.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_BITMAP_H
+#include FT_GLYPH_H
+#include FT_OUTLINE_H
 
-/* struct holding a glyph metrics */
-struct glyph_metrics {
-	float bearing[2];
-	float advance[2];
-	float size[2];
-
-	double st0[2];
-	double st1[2];
-};
-
-struct raster_glyph {
-	struct raster_glyph *next;
-
-	uint32_t rune;
-	struct bitmap bitmap;
-	struct glyph_metrics metrics;
-};
-
-static const char *txt_hdr_fmt =
-"glyph_count=%d\n"
-"render_size=%d\n"
-"space_advance=%f\n"
-"height=%f\n";
-
-static const char *txt_glyph_fmt =
-"\n# Glyph %d (%s)\n"
-"rune=%d\n"
-"horizontal_bearing=%f\n"
-"vertical_bearing=%f\n"
-"horizontal_advance=%f\n"
-"vertical_advance=%f\n"
-"width=%f\n"
-"height=%f\n"
-"s0=%f\n"
-"t0=%f\n"
-"s1=%f\n"
-"t1=%f\n";
-
-static FT_Library ft_library;
-static FT_Face ft_face;
+#include <limits.h>
+#include <stdarg.h>
 
 int main(int argc, char **argv)
 {
 	struct fr *fr, fr_storage;
+	struct raster_stats stats;
+	FT_Library ft_library;
+	FT_Face *faces;
+	const face_t *face;
+	int i;
 
 	FT_Error error;
 
@@ -69,25 +37,45 @@ int main(int argc, char **argv)
 	fr->argc = argc;
 	fr->argv = argv;
 
+	/* "fr sweep" parses the following arguments as options of its own. */
+	if (argc > 1 && !strcmp(argv[1], "sweep")) {
+		fr->sweep = 1;
+		fr->argc--;
+		fr->argv++;
+	}
+
 	parse_options(fr);
 
+	if (fr->sweep) {
+		fr->return_value = sweep_fonts(fr);
+		goto done;
+	}
+
 	error = FT_Init_FreeType(&ft_library);
 	if (error)
 		die("unable to initialize FreeType");
 
-	error = FT_New_Face(ft_library, fr->font_filename, 0, &ft_face);
-	if (error)
-		die("unable to load font %s", fr->font_filename);
-
-	error = FT_Set_Pixel_Sizes(ft_face, 0, fr->pixel_height);
-	if (error)
-		die("unable to set font size");
+	faces = malloc(sizeof(FT_Face) * fr->num_faces);
+	if (!faces)
+		die("out of memory");
+	for (i = 0, face = fr->faces; face; face = face->next, i++) {
+		error = FT_New_Face(ft_library, face->filename, face->index,
+				    &faces[i]);
+		if (error)
+			die("unable to load face %d of font %s",
+			    face->index, face->filename);
+	}
 
-	rasterize_font(ft_face, fr);
+	fr->stats = &stats;
+	if (rasterize_font(faces, fr->num_faces, fr))
+		die("%s", stats.failure);
 
-	FT_Done_Face(ft_face);
+	for (i = 0; i < fr->num_faces; i++)
+		FT_Done_Face(faces[i]);
+	free(faces);
 	FT_Done_FreeType(ft_library);
 
+done:
 	/* clean up */
 	if (fr->atlas_filename) {
 		free(fr->atlas_filename);
@@ -97,10 +85,28 @@ int main(int argc, char **argv)
 		free(fr->metrics_filename);
 		fr->metrics_filename = NULL;
 	}
-	if (fr->font_filename) {
-		free(fr->font_filename);
-		fr->font_filename = NULL;
+	free(fr->curves_filename);
+	fr->curves_filename = NULL;
+	free(fr->sweep_dir);
+	free(fr->sweep_output);
+	fr->sweep_dir = NULL;
+	fr->sweep_output = NULL;
+	face_t *font = fr->faces;
+	while (font) {
+		face_t *next = font->next;
+		free(font->filename);
+		free(font);
+		font = next;
 	}
+	fr->faces = NULL;
+
+	free(fr->pixel_heights);
+	fr->pixel_heights = NULL;
+
+	for (i = 0; i < fr->num_strings; i++)
+		free(fr->strings[i]);
+	free(fr->strings);
+	fr->strings = NULL;
 
 	range_t *range = fr->ranges;
 	while (range) {
@@ -114,67 +120,6 @@ int main(int argc, char **argv)
 }
 
 
-void write_binary_glyph(FILE *fp, const struct glyph_metrics *metrics)
-{
-	struct glyph_def m;
-
-	m.bearing[0] = metrics->bearing[0];
-	m.bearing[1] = metrics->bearing[1];
-	m.advance[0] = metrics->advance[0];
-	m.advance[1] = metrics->advance[1];
-	m.size[0] = metrics->size[0];
-	m.size[1] = metrics->size[1];
-	m.st0[0] = metrics->st0[0] * (double)UINT16_MAX;
-	m.st0[1] = metrics->st0[1] * (double)UINT16_MAX;
-	m.st1[0] = metrics->st1[0] * (double)UINT16_MAX;
-	m.st1[1] = metrics->st1[1] * (double)UINT16_MAX;
-
-	fwrite(&m, sizeof(m), 1, fp);
-}
-
-void write_text_glyph(FILE *fp, int i, const struct raster_glyph *glyph)
-{
-	const struct glyph_metrics *metrics;
-	metrics = &glyph->metrics;
-
-	/* Encode unicode code point into utf8 stream */
-	uint32_t rune = glyph->rune;
-	char utf8[5];
-	if (rune < 0x80) {
-		/* 1 byte encoding */
-		utf8[0] = (uint8_t)rune;
-		utf8[1] = '\0';
-	} else if (rune < 0x800) {
-		/* 2 bytes encoding */
-		utf8[0] = 0xC0 | (rune >> 6);
-		utf8[1] = 0x80 | (rune & 0x3F);
-		utf8[2] = '\0';
-	} else if (rune < 0x10000) {
-		/* 3 bytes encoding */
-		utf8[0] = 0xE0 | (rune >> 12);
-		utf8[1] = 0x80 | ((rune >> 6) & 0x3F);
-		utf8[2] = 0x80 | (rune & 0x3F);
-		utf8[3] = '\0';
-	} else if (rune < 0x200000) {
-		/* 4 bytes encoding */
-		utf8[0] = 0xF0 | (rune >> 24);
-		utf8[1] = 0x80 | ((rune >> 12) & 0x3F);
-		utf8[2] = 0x80 | ((rune >> 6) & 0x3F);
-		utf8[3] = 0x80 | (rune & 0x3F);
-		utf8[4] = '\0';
-	} else {
-		/* not supported yet */
-		utf8[0] = '\0';
-	}
-
-	fprintf(fp, txt_glyph_fmt, i, utf8, glyph->rune,
-		metrics->bearing[0], metrics->bearing[1],
-		metrics->advance[0], metrics->advance[1],
-		metrics->size[0], metrics->size[1],
-		metrics->st0[0], metrics->st0[1],
-		metrics->st1[0], metrics->st1[1]);
-}
-
 float space_advance(FT_Face face, int size)
 {
 	float advance;
@@ -194,320 +139,1032 @@ float space_advance(FT_Face face, int size)
 }
 
 
-int write_metrics(FT_Face face, const struct raster_glyph *glyph_list,
-		  int num_glyphs, int pixel_height, const char *path, int format)
+/*
+ * Returns the index of the first face of the chain having a glyph for
+ * the rune and stores that glyph index, or returns -1 if no face has it.
+ */
+int resolve_rune(FT_Face *faces, int num_faces, uint32_t rune,
+		 FT_UInt *glyph_index)
 {
-	const struct raster_glyph *glyph;
-	struct metrics_hdr def;
-	FILE *fp = NULL;
+	int i;
 
-	fp = fopen(path, format == MF_BINARY ? "wb" : "w");
-	if (!fp) {
-		error("opening %s", path);
-		return 1;
+	for (i = 0; i < num_faces; i++) {
+		*glyph_index = FT_Get_Char_Index(faces[i], rune);
+		if (*glyph_index)
+			return i;
 	}
 
-	int size = pixel_height;
-	float advance = space_advance(face, pixel_height);
-	float height = (float)face->height / (64.0f * (float)size);
+	return -1;
+}
+
+/* Largest atlas side tried by dry runs */
+#define MAX_DRY_RUN_SQUARE 16384
+
+/* FreeType default distance field spread, in pixels. */
+#define SDF_SPREAD 8
+
+static const FT_Render_Mode render_modes[RV_COUNT] = {
+	[RV_NORMAL] = FT_RENDER_MODE_NORMAL,
+	[RV_MONO] = FT_RENDER_MODE_MONO,
+	[RV_SDF] = FT_RENDER_MODE_SDF,
+};
+
+/*
+ * Sets the box of the bitmap the renderer would give for the loaded
+ * glyph, without rendering it: box gets its size but no buffer. Outline
+ * boxes come from the hinted control box, rounded as FreeType does for
+ * the render mode, distance fields adding their spread on every side.
+ * in_place tells whether the slot itself or a copy would be rendered.
+ */
+static void glyph_box(FT_GlyphSlot slot, int variant, int in_place,
+		      FT_Bitmap *box, FT_Int *left, FT_Int *top)
+{
+	FT_BBox cbox;
+	FT_Pos x0, y0, x1, y1;
+
+	memset(box, 0, sizeof(*box));
+	if (slot->format != FT_GLYPH_FORMAT_OUTLINE) {
+		box->width = slot->bitmap.width;
+		box->rows = slot->bitmap.rows;
+		*left = slot->bitmap_left;
+		*top = slot->bitmap_top;
+		return;
+	}
 
-	switch (format) {
-	case MF_TEXT:
-		fprintf(fp, txt_hdr_fmt, num_glyphs, size, advance, height);
-		int i = 0;
-		glyph = glyph_list;
-		while (glyph) {
-			write_text_glyph(fp, i, glyph);
-			++i;
-			glyph = glyph->next;
+	FT_Outline_Get_CBox(&slot->outline, &cbox);
+	x0 = cbox.xMin >> 6;
+	y0 = cbox.yMin >> 6;
+	x1 = cbox.xMax >> 6;
+	y1 = cbox.yMax >> 6;
+	cbox.xMin &= 63;
+	cbox.yMin &= 63;
+	cbox.xMax &= 63;
+	cbox.yMax &= 63;
+
+	if (variant == RV_MONO) {
+		/* Rounded so that pixel centers are included */
+		x0 += (cbox.xMin + 31) >> 6;
+		x1 += (cbox.xMax + 32) >> 6;
+		y0 += (cbox.yMin + 31) >> 6;
+		y1 += (cbox.yMax + 32) >> 6;
+
+		/* A collapsed box grows a pixel towards most of the outline */
+		if (x0 == x1) {
+			if (((cbox.xMin + 31) & 63) - 31 + ((cbox.xMax + 32) & 63) - 32 < 0)
+				x0--;
+			else
+				x1++;
 		}
-		break;
-	case MF_BINARY:
-		def.glyph_count = num_glyphs;
-		def.space_advance = advance;
-		def.lut_offset = sizeof(struct metrics_hdr);
-		def.glyph_offset = def.lut_offset + sizeof(uint32_t) * num_glyphs;
-		fwrite(&def, sizeof(struct metrics_hdr), 1, fp);
-
-		for (glyph = glyph_list; glyph; glyph = glyph->next)
-			fwrite(&glyph->rune, sizeof(uint32_t), 1, fp);
-		for (glyph = glyph_list; glyph; glyph = glyph->next)
-			write_binary_glyph(fp, &glyph->metrics);
-		break;
-	}
-
-	fclose(fp);
-	return 0;
+		if (y0 == y1) {
+			if (((cbox.yMin + 31) & 63) - 31 + ((cbox.yMax + 32) & 63) - 32 < 0)
+				y0--;
+			else
+				y1++;
+		}
+	} else {
+		x1 += (cbox.xMax + 63) >> 6;
+		y1 += (cbox.yMax + 63) >> 6;
+	}
+
+	/*
+	 * Empty outlines have no bitmap when rendered in place, a copy
+	 * collapses to a pixel like any other box.
+	 */
+	if (in_place && !slot->outline.n_points)
+		x1 = x0 = y1 = y0 = 0;
+
+	if (variant == RV_SDF && x1 > x0 && y1 > y0) {
+		x0 -= SDF_SPREAD;
+		y0 -= SDF_SPREAD;
+		x1 += SDF_SPREAD;
+		y1 += SDF_SPREAD;
+	}
+
+	box->width = x1 - x0;
+	box->rows = y1 - y0;
+	*left = x0;
+	*top = y1;
 }
 
-int write_atlas(const struct bitmap *bp, const char *filename)
+/*
+ * Builds a raster glyph out of a rendered bitmap and the metrics of the
+ * loaded glyph. margin is the space the renderer added around the
+ * outline box (the distance field spread), it is accounted like the
+ * border. The border grows by the margin of the effects, whose channels
+ * are then filled. A bitmap without buffer only gives the glyph its size.
+ * Returns NULL if the bitmap is empty, or when out of memory which fails
+ * the context.
+ */
+static struct raster_glyph *new_raster_glyph(struct raster_context *ctx,
+					     uint32_t rune, int face_index,
+					     const FT_Bitmap *ft_bitmap,
+					     const FT_Glyph_Metrics *ft_metrics,
+					     int border, int margin, int size)
 {
-	FILE *fp = NULL;
-	png_structp png_ptr = NULL;
-	png_infop info_ptr = NULL;
-	png_byte ** row_pointers = NULL;
-	int x, y;
+	const struct effects *effects = &ctx->effects;
+	int width = ft_bitmap->width;
+	int height = ft_bitmap->rows;
+	if (!width || !height)
+		return NULL;
+
+	border += effects->margin;
+	width += border * 2;
+	height += border * 2;
+
+	struct raster_glyph *glyph = calloc(1, sizeof(*glyph));
+	if (!glyph) {
+		raster_fail(ctx, "out of memory");
+		return NULL;
+	}
+	if (ft_bitmap->buffer) {
+		if (bitmap_alloc_channels(&glyph->bitmap, width, height,
+					  effects->channels)) {
+			free(glyph);
+			raster_fail(ctx, "out of memory");
+			return NULL;
+		}
+		bitmap_blit_ft_bitmap(&glyph->bitmap, ft_bitmap, border, border);
+		if (apply_effects(effects, &glyph->bitmap)) {
+			bitmap_free_pixels(&glyph->bitmap);
+			free(glyph);
+			raster_fail(ctx, "out of memory");
+			return NULL;
+		}
+	} else {
+		glyph->bitmap.width = width;
+		glyph->bitmap.height = height;
+	}
 
-	const int pixel_size = sizeof(uint8_t);
+	glyph->rune = rune;
+	glyph->x = -1;
+	glyph->y = -1;
+	struct glyph_metrics *metrics = &glyph->metrics;
+	/*
+	 * Values of FT_Glyph_Metrics are expressed in 26.6
+	 * fractional pixel format.
+	 */
+	const float fborder = 63.0f * (float)(border + margin);
+	const float frac = 63.0f * (float)size;
+	metrics->advance[0] = (float)ft_metrics->horiAdvance / frac;
+	metrics->advance[1] = (float)ft_metrics->vertAdvance / frac;
+	metrics->bearing[0] = (ft_metrics->horiBearingX - fborder) / frac;
+	metrics->bearing[1] = (ft_metrics->horiBearingY + fborder) / frac;
+	metrics->size[0] = (ft_metrics->width + (fborder * 2.0f)) / frac;
+	metrics->size[1] = (ft_metrics->height + (fborder * 2.0f)) / frac;
+	metrics->face = face_index;
+
+	return glyph;
+}
 
-	fp = fopen(filename, "wb");
-	if (!fp)
-		return 1;
+/* Appends a glyph to the list of its variant and to its size group */
+static void add_glyph(struct raster_context *ctx, int v, int k,
+		      struct raster_glyph *glyph)
+{
+	struct size_group *group = &ctx->groups[v * ctx->num_sizes + k];
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
-       		return 1;
+	*ctx->tails[v] = glyph;
+	ctx->tails[v] = &glyph->next;
+	ctx->num_glyphs[v]++;
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr) {
-		png_destroy_write_struct(&png_ptr, NULL);
-		return 1;
-	}
+	if (!group->num_glyphs++)
+		group->glyphs = glyph;
 
-	if (setjmp(png_jmpbuf(png_ptr)))
-        	goto png_failure;
+	if (ctx->emit)
+		ctx->emit(glyph, v, ctx->emit_data);
+}
 
-	/* Set image attributes */
-	png_set_IHDR(png_ptr,
-		     info_ptr,
-		     bp->width,
-		     bp->height,
-		     8, // Depth, bpp
-		     PNG_COLOR_TYPE_GRAY, //PNG_COLOR_TYPE_RGB,
-		     PNG_INTERLACE_NONE,
-		     PNG_COMPRESSION_TYPE_DEFAULT,
-		     PNG_FILTER_TYPE_DEFAULT);
+/*
+ * Renders a phase of the loaded glyph for a variant: the glyph itself
+ * when outline is NULL, otherwise a copy of outline moved right by the
+ * phase. With phases, horizontal metrics come from the rendered box and
+ * the advance is the unhinted one, as the runtime places glyphs at
+ * fractional pen positions.
+ * Returns NULL if the glyph could not be rendered or is empty, or when
+ * the context failed.
+ */
+static struct raster_glyph *render_phase(struct raster_context *ctx,
+					 FT_GlyphSlot slot, FT_Glyph outline,
+					 uint32_t rune, int face_index,
+					 int variant, int phase, int size,
+					 const struct fr *fr)
+{
+	FT_Render_Mode mode = render_modes[variant];
+	FT_Pos dx = phase * 64 / ctx->phases;
+	int margin = variant == RV_SDF ? SDF_SPREAD : 0;
+	FT_Glyph_Metrics ft_metrics = slot->metrics;
+	const FT_Bitmap *ft_bitmap;
+	struct raster_glyph *glyph;
+	FT_Glyph copy = NULL;
+	FT_Bitmap box;
+	FT_Int left, top;
 
-	/* Initialize rows of PNG */
-	row_pointers = png_malloc(png_ptr, bp->height * sizeof(png_byte *));
-	for (y = 0; y < bp->height; ++y) {
-		png_byte *row =	png_malloc(png_ptr, sizeof(uint8_t) * bp->width * pixel_size);
-		row_pointers[y] = row;
-		for (x = 0; x < bp->width; ++x)
-			*row++ = *bitmap_get_pixel(bp, x, y);
+	/*
+	 * A single rendering renders in place, otherwise every one renders
+	 * its own copy of the outline. Dry runs only need the box.
+	 */
+	if (ctx->dry_run) {
+		int in_place = ctx->num_variants == 1 && ctx->phases == 1;
+
+		if (dx && slot->format == FT_GLYPH_FORMAT_OUTLINE)
+			FT_Outline_Translate(&slot->outline, dx, 0);
+		glyph_box(slot, variant, in_place, &box, &left, &top);
+		if (dx && slot->format == FT_GLYPH_FORMAT_OUTLINE)
+			FT_Outline_Translate(&slot->outline, -dx, 0);
+		ft_bitmap = &box;
+	} else if (!outline) {
+		if (FT_Render_Glyph(slot, mode)) {
+			warning("skipping rune U+%04X (unable to render glyph)", rune);
+			return NULL;
+		}
+		ft_bitmap = &slot->bitmap;
+		left = slot->bitmap_left;
+	} else {
+		if (FT_Glyph_Copy(outline, &copy)) {
+			warning("skipping rune U+%04X (unable to copy outline)", rune);
+			return NULL;
+		}
+		/* Embedded bitmaps can't move, all their phases are alike. */
+		if (dx && copy->format == FT_GLYPH_FORMAT_OUTLINE)
+			FT_Outline_Translate(&((FT_OutlineGlyph)copy)->outline,
+					     dx, 0);
+		if (FT_Glyph_To_Bitmap(&copy, mode, NULL, 1)) {
+			FT_Done_Glyph(copy);
+			warning("skipping rune U+%04X (unable to render %s glyph)",
+				rune, variant_name(variant));
+			return NULL;
+		}
+		ft_bitmap = &((FT_BitmapGlyph)copy)->bitmap;
+		left = ((FT_BitmapGlyph)copy)->left;
 	}
 
-	/* Write the image data to "fp" */
-	png_init_io(png_ptr, fp);
-	png_set_rows(png_ptr, info_ptr, row_pointers);
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+	if (ctx->phases > 1) {
+		ft_metrics.horiBearingX = (left + margin) * 64;
+		ft_metrics.width = ((int)ft_bitmap->width - margin * 2) * 64;
+		ft_metrics.horiAdvance = slot->linearHoriAdvance >> 10;
+	}
 
-	fclose(fp);
+	glyph = new_raster_glyph(ctx, rune, face_index, ft_bitmap, &ft_metrics,
+				 fr->border, margin, size);
+	if (copy)
+		FT_Done_Glyph(copy);
+	if (!glyph) {
+		if (!phase && !ctx->failure[0])
+			warning("skipping rune U+%04X (zero width/height)", rune);
+		return NULL;
+	}
+	glyph->metrics.phase = phase;
 
-	for (y = 0; y < bp->height; y++)
-		png_free(png_ptr, row_pointers[y]);
-	png_free(png_ptr, row_pointers);
+	return glyph;
+}
 
-	return 0;
+/* Frees the first n phases of a rune, none of them being emitted yet */
+static void drop_phases(struct raster_glyph **phases, int n)
+{
+	int p;
 
-png_failure:
-	png_destroy_write_struct (&png_ptr, &info_ptr);
-	return 1;
+	for (p = 0; p < n; p++) {
+		if (!phases[p])
+			continue;
+		bitmap_free_pixels(&phases[p]->bitmap);
+		free(phases[p]);
+	}
 }
 
-
-int rasterize_runes(FT_Face face, struct raster_glyph **head, int *num_glyphs,
-		    const range_t *range, const struct fr *fr)
+/*
+ * Rasterizes the runes of the range into the size group k. Each glyph
+ * is loaded and hinted once, then rendered for every variant and phase
+ * from a copy of the same outline. A phase with the very same pixels as
+ * an earlier phase of the rune shares its place in the atlas. Stops
+ * once the context failed.
+ */
+static void rasterize_runes(struct raster_context *ctx, int k,
+			    const range_t *range, const struct fr *fr)
 {
-	int size = fr->pixel_height;
-	int border = fr->border;
-	int no_antialias = fr->no_antialias;
+	int size = ctx->groups[k].pixel_height;
+	struct raster_glyph *phases[MAX_PHASES];
 
+	FT_Face face;
 	FT_UInt glyph_index;
 	FT_Int32 load_flags;
-	FT_Render_Mode render_mode;
 	FT_GlyphSlot slot;
+	FT_Glyph outline;
 	uint32_t i;
+	int v, p, q;
 
-	if (no_antialias) {
-		//load_flags = FT_LOAD_TARGET_MONO | FT_LOAD_NO_BITMAP;
-		load_flags = FT_LOAD_DEFAULT | FT_LOAD_NO_BITMAP;
-		render_mode = FT_RENDER_MODE_MONO;
-	} else {
-		load_flags = FT_LOAD_DEFAULT | FT_LOAD_NO_BITMAP;
-		render_mode = FT_RENDER_MODE_NORMAL;
-	}
+	for (i = range->lo; i <= range->hi; i++) {
+		if (ctx->skip_rune && ctx->skip_rune(i, k, ctx->skip_data))
+			continue;
 
-	FT_Bitmap ft_bitmap;
-	FT_Bitmap_Init(&ft_bitmap);
-	/*
-	 * Because the raster_glyph list is single-linked, every insertion
-	 * is done at the front. Therefore runes are processed in reverse
-	 * order so that later steps using the list have the 'right' order.
-	 * Not that it is *that* important but the resulting atlas texture
-	 * won't look awkward.
-	 */
-	for (i = range->hi; i >= range->lo; i--) {
-		glyph_index = FT_Get_Char_Index(face, i);
+		int face_index = resolve_rune(ctx->faces, ctx->num_faces, i,
+					      &glyph_index);
+		if (face_index < 0) {
+			warning("skipping rune U+%04X (glyph unavailable)", i);
+			continue;
+		}
 
+		/*
+		 * When the face has a strike at the render size, glyphs
+		 * are taken from it and FreeType falls back to the outline
+		 * of those missing from the strike.
+		 */
+		load_flags = FT_LOAD_DEFAULT;
+		if (!ctx->use_strike[face_index])
+			load_flags |= FT_LOAD_NO_BITMAP;
+
+		face = ctx->faces[face_index];
 		if (FT_Load_Glyph(face, glyph_index, load_flags)) {
 			warning("skipping rune U+%04X (unable to load glyph)", i);
 			continue;
 		}
 
 		slot = face->glyph;
-		if (FT_Render_Glyph(slot, render_mode)) {
-			warning("skipping rune U+%04X (unable to render glyph)", i);
+		if (slot->format == FT_GLYPH_FORMAT_BITMAP)
+			ctx->num_embedded++;
+		else
+			ctx->num_outlines++;
+		if (fr->option_verbose > 1)
+			printf("rune U+%04X at %dpx: %s\n", i, size,
+			       slot->format == FT_GLYPH_FORMAT_BITMAP ?
+			       "embedded bitmap" : "outline");
+		outline = NULL;
+		if ((ctx->num_variants > 1 || ctx->phases > 1) && !ctx->dry_run &&
+		    FT_Get_Glyph(slot, &outline)) {
+			warning("skipping rune U+%04X (unable to copy outline)", i);
 			continue;
 		}
 
-		if (!glyph_index) {
-			warning("skipping rune U+%04X (glyph unavailable)", i);
-			continue;
+		for (v = 0; v < ctx->num_variants; v++) {
+			for (p = 0; p < ctx->phases; p++) {
+				phases[p] = render_phase(ctx, slot, outline, i,
+							 face_index,
+							 ctx->variants[v], p,
+							 size, fr);
+				if (ctx->failure[0]) {
+					drop_phases(phases, p);
+					if (outline)
+						FT_Done_Glyph(outline);
+					return;
+				}
+				if (!phases[p] || !phases[p]->bitmap.pixels)
+					continue;
+
+				for (q = 0; q < p; q++) {
+					if (phases[q] && !phases[q]->shared &&
+					    bitmap_equal(&phases[q]->bitmap,
+							 &phases[p]->bitmap)) {
+						phases[p]->shared = phases[q];
+						bitmap_free_pixels(&phases[p]->bitmap);
+						break;
+					}
+				}
+			}
+
+			/* Pixels are compared before any glyph is emitted. */
+			for (p = 0; p < ctx->phases; p++) {
+				if (!phases[p])
+					continue;
+				if (phases[p]->shared)
+					ctx->num_shared[v]++;
+				add_glyph(ctx, v, k, phases[p]);
+			}
 		}
 
+		if (outline)
+			FT_Done_Glyph(outline);
+	}
+}
 
-		int width = slot->bitmap.width;
-		int height = slot->bitmap.rows;
-		if (!width || !height) {
-			warning("skipping rune U+%04X (zero width/height)", i);
-			continue;
+/*
+ * Decodes the UTF-8 sequence at *s and moves past it. Returns the rune,
+ * or U+FFFD for an invalid sequence.
+ */
+static uint32_t decode_utf8(const char **s)
+{
+	const uint8_t *p = (const uint8_t *)*s;
+	uint32_t rune;
+	int i, n;
+
+	if (p[0] < 0x80) {
+		*s += 1;
+		return p[0];
+	} else if ((p[0] & 0xE0) == 0xC0) {
+		rune = p[0] & 0x1F;
+		n = 1;
+	} else if ((p[0] & 0xF0) == 0xE0) {
+		rune = p[0] & 0x0F;
+		n = 2;
+	} else if ((p[0] & 0xF8) == 0xF0) {
+		rune = p[0] & 0x07;
+		n = 3;
+	} else {
+		*s += 1;
+		return 0xFFFD;
+	}
+
+	for (i = 1; i <= n; i++) {
+		if ((p[i] & 0xC0) != 0x80) {
+			*s += i;
+			return 0xFFFD;
 		}
+		rune = (rune << 6) | (p[i] & 0x3F);
+	}
+	*s += n + 1;
 
-		width += border * 2;
-		height += border * 2;
+	return rune;
+}
 
-		/*
-		 * Make sure the bitmap is 8 bpp
-		 */
-		struct raster_glyph *glyph = malloc(sizeof(*glyph));
-		bitmap_alloc_pixels(&glyph->bitmap, width, height);
-#if 0
-		FT_Bitmap_Convert(ft_library, &slot->bitmap, &ft_bitmap, 0);
-		bitmap_blit_ft_bitmap(&glyph->bitmap, &ft_bitmap,
-				      border, border);
-#else
-		bitmap_blit_ft_bitmap(&glyph->bitmap, &slot->bitmap,
-				      border, border);
-#endif
-
-		glyph->rune = i;
-		struct glyph_metrics *metrics = &glyph->metrics;
-		/*
-		 * Values of FT_Glyph_Metrics are expressed in 26.6
-		 * fractional pixel format.
-		 */
-		const float fborder = 63.0f * (float)border;
-		const float frac = 63.0f * (float)size;
-		metrics->advance[0] = (float)slot->metrics.horiAdvance / frac;
-		metrics->advance[1] = (float)slot->metrics.vertAdvance / frac;
-		metrics->bearing[0] = (slot->metrics.horiBearingX - fborder) / frac;
-		metrics->bearing[1] = (slot->metrics.horiBearingY - fborder) / frac;
-		metrics->size[0] = (slot->metrics.width + (fborder * 2.0f)) / frac;
-		metrics->size[1] = (slot->metrics.height + (fborder * 2.0f)) / frac;
-
-		/* Advance next glyph */
-		glyph->next = *head;
-		*head = glyph;
-		(*num_glyphs)++;
-	}
-	FT_Bitmap_Done(ft_library, &ft_bitmap);
+/* A glyph of a string sprite, at its pixel position on the base line */
+struct sprite_piece {
+	struct bitmap bitmap;
+	int x, y;
+};
+
+/*
+ * Lays out a string with kerning and renders it as a single glyph of
+ * size group k, for every variant. Glyphs are rendered one by one at
+ * their pen position and merged, kerning only applying between glyphs
+ * of the same face. The sprite is keyed by the string index.
+ */
+static void rasterize_string(struct raster_context *ctx, int k, int id,
+			     const char *text, const struct fr *fr)
+{
+	int size = ctx->groups[k].pixel_height;
+	uint32_t key = STRING_RUNE_FLAG | id;
+	int v;
+
+	if (!*text)
+		return;
+	if (ctx->skip_rune && ctx->skip_rune(key, k, ctx->skip_data))
+		return;
+
+	for (v = 0; v < ctx->num_variants; v++) {
+		int variant = ctx->variants[v];
+		struct sprite_piece *pieces = NULL;
+		int num_pieces = 0;
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+		int prev_face = -1;
+		FT_UInt prev_index = 0;
+		FT_Pos pen = 0;
+		const char *s = text;
+		int i;
+
+		while (*s) {
+			uint32_t rune = decode_utf8(&s);
+			FT_UInt glyph_index;
+			FT_Int32 load_flags;
+			FT_GlyphSlot slot;
+			FT_Vector kerning;
+			FT_Bitmap box;
+			FT_Int left, top;
+			FT_Face face;
+
+			int face_index = resolve_rune(ctx->faces, ctx->num_faces,
+						      rune, &glyph_index);
+			if (face_index < 0) {
+				warning("string %d: skipping rune U+%04X (glyph unavailable)",
+					id, rune);
+				continue;
+			}
+
+			face = ctx->faces[face_index];
+			if (face_index == prev_face && FT_HAS_KERNING(face) &&
+			    !FT_Get_Kerning(face, prev_index, glyph_index,
+					    FT_KERNING_DEFAULT, &kerning))
+				pen += kerning.x;
+			prev_face = face_index;
+			prev_index = glyph_index;
+
+			load_flags = FT_LOAD_DEFAULT;
+			if (!ctx->use_strike[face_index])
+				load_flags |= FT_LOAD_NO_BITMAP;
+			if (FT_Load_Glyph(face, glyph_index, load_flags) ||
+			    (!ctx->dry_run &&
+			     FT_Render_Glyph(face->glyph, render_modes[variant]))) {
+				warning("string %d: skipping rune U+%04X (unable to render glyph)",
+					id, rune);
+				continue;
+			}
+
+			slot = face->glyph;
+			if (ctx->dry_run) {
+				glyph_box(slot, variant, 1, &box, &left, &top);
+			} else {
+				box = slot->bitmap;
+				left = slot->bitmap_left;
+				top = slot->bitmap_top;
+			}
+			if (box.width && box.rows) {
+				struct sprite_piece *piece;
+
+				piece = realloc(pieces, sizeof(*pieces) * (num_pieces + 1));
+				if (!piece) {
+					raster_fail(ctx, "out of memory");
+					break;
+				}
+				pieces = piece;
+				piece = &pieces[num_pieces++];
+				memset(&piece->bitmap, 0, sizeof(piece->bitmap));
+				if (box.buffer) {
+					if (bitmap_alloc_pixels(&piece->bitmap, box.width,
+								box.rows)) {
+						raster_fail(ctx, "out of memory");
+						break;
+					}
+					bitmap_blit_ft_bitmap(&piece->bitmap, &box, 0, 0);
+				} else {
+					piece->bitmap.width = box.width;
+					piece->bitmap.height = box.rows;
+				}
+				piece->x = ((pen + 32) >> 6) + left;
+				piece->y = -top;
+
+				x0 = piece->x < x0 ? piece->x : x0;
+				y0 = piece->y < y0 ? piece->y : y0;
+				if (piece->x + piece->bitmap.width > x1)
+					x1 = piece->x + piece->bitmap.width;
+				if (piece->y + piece->bitmap.height > y1)
+					y1 = piece->y + piece->bitmap.height;
+			}
+			pen += slot->advance.x;
+		}
+
+		if (!num_pieces && !ctx->failure[0]) {
+			warning("skipping string %d (nothing to render)", id);
+			return;
+		}
+
+		struct bitmap sprite;
+		memset(&sprite, 0, sizeof(sprite));
+		sprite.width = x1 - x0;
+		sprite.height = y1 - y0;
+		if (!ctx->dry_run && !ctx->failure[0] &&
+		    bitmap_alloc_pixels(&sprite, sprite.width, sprite.height))
+			raster_fail(ctx, "out of memory");
+		for (i = 0; i < num_pieces; i++) {
+			if (ctx->failure[0]) {
+				bitmap_free_pixels(&pieces[i].bitmap);
+				continue;
+			}
+			if (pieces[i].bitmap.pixels)
+				bitmap_blit_max(&sprite, &pieces[i].bitmap,
+						pieces[i].x - x0, pieces[i].y - y0);
+			bitmap_free_pixels(&pieces[i].bitmap);
+		}
+		free(pieces);
+		if (ctx->failure[0]) {
+			bitmap_free_pixels(&sprite);
+			return;
+		}
+
+		/* The merged bitmap already holds any distance field margin. */
+		FT_Bitmap ft_bitmap;
+		FT_Glyph_Metrics ft_metrics;
+		memset(&ft_bitmap, 0, sizeof(ft_bitmap));
+		ft_bitmap.rows = sprite.height;
+		ft_bitmap.width = sprite.width;
+		ft_bitmap.pitch = sprite.width;
+		ft_bitmap.buffer = sprite.pixels;
+		ft_bitmap.num_grays = 256;
+		ft_bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+		memset(&ft_metrics, 0, sizeof(ft_metrics));
+		ft_metrics.width = sprite.width * 64;
+		ft_metrics.height = sprite.height * 64;
+		ft_metrics.horiBearingX = x0 * 64;
+		ft_metrics.horiBearingY = -y0 * 64;
+		ft_metrics.horiAdvance = pen;
+		ft_metrics.vertAdvance = ctx->faces[0]->size->metrics.height;
+
+		struct raster_glyph *glyph;
+		glyph = new_raster_glyph(ctx, key, 0, &ft_bitmap, &ft_metrics,
+					 fr->border, 0, size);
+		bitmap_free_pixels(&sprite);
+		if (!glyph)
+			return;
+		add_glyph(ctx, v, k, glyph);
+	}
+}
+
+/* Returns 0 or 1 when out of memory, which fails the context */
+int raster_context_init(struct raster_context *ctx, FT_Face *faces,
+			int num_faces, const struct fr *fr)
+{
+	int v;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->faces = faces;
+	ctx->num_faces = num_faces;
+
+	/*
+	 * Without explicit variants, a single one is rendered according
+	 * to the antialiasing option and written to the given files.
+	 */
+	if (fr->num_variants) {
+		ctx->num_variants = fr->num_variants;
+		memcpy(ctx->variants, fr->variants,
+		       sizeof(int) * ctx->num_variants);
+	} else {
+		ctx->num_variants = 1;
+		ctx->variants[0] = fr->no_antialias ? RV_MONO : RV_NORMAL;
+	}
+
+	ctx->dry_run = fr->dry_run;
+	ctx->phases = fr->phases;
+	if (effects_init(&ctx->effects, fr))
+		goto failure;
+
+	/*
+	 * Distance fields are computed from outlines, a bitmap would only
+	 * give a blurry field.
+	 */
+	ctx->embedded_bitmaps = fr->embedded_bitmaps;
+	for (v = 0; v < ctx->num_variants; v++) {
+		if (ctx->embedded_bitmaps && ctx->variants[v] == RV_SDF) {
+			warning("embedded bitmaps are not used for the sdf variant");
+			ctx->embedded_bitmaps = 0;
+		}
+	}
+	ctx->use_strike = calloc(num_faces, sizeof(int));
+	if (!ctx->use_strike)
+		goto failure;
+
+	ctx->num_sizes = fr->num_sizes;
+	ctx->groups = calloc(ctx->num_variants * ctx->num_sizes,
+			     sizeof(struct size_group));
+	if (!ctx->groups)
+		goto failure;
+
+	for (v = 0; v < ctx->num_variants; v++)
+		ctx->tails[v] = &ctx->glyphs[v];
 
 	return 0;
+
+failure:
+	raster_fail(ctx, "out of memory");
+	return 1;
+}
+
+void raster_context_done(struct raster_context *ctx)
+{
+	int v;
+
+	for (v = 0; v < ctx->num_variants; v++) {
+		while (ctx->glyphs[v]) {
+			struct raster_glyph *next = ctx->glyphs[v]->next;
+			bitmap_free_pixels(&ctx->glyphs[v]->bitmap);
+			free(ctx->glyphs[v]);
+			ctx->glyphs[v] = next;
+		}
+	}
+	free(ctx->groups);
+	ctx->groups = NULL;
+	free(ctx->use_strike);
+	ctx->use_strike = NULL;
+	effects_done(&ctx->effects);
 }
 
-/* Return numbers of glyphs actually in the atlas */
-int fill_atlas_and_metrics(struct bitmap *atlas, struct raster_glyph *glyph,
-			   int padding)
+/*
+ * Records the first error met while rasterizing. The rasterization then
+ * winds down and rasterize_font returns the error.
+ */
+void raster_fail(struct raster_context *ctx, const char *fmt, ...)
+{
+	va_list params;
+
+	if (ctx->failure[0])
+		return;
+	va_start(params, fmt);
+	vsnprintf(ctx->failure, sizeof(ctx->failure), fmt, params);
+	va_end(params);
+}
+
+/* Returns whether the face has an embedded bitmap strike for the size */
+int has_strike(FT_Face face, int size)
 {
 	int i;
-	int pen_x = padding;
-	int pen_y = padding;
-	int line_height = 0;
-	double atlas_scale[2] = {
-		1.0 / (double)atlas->width,
-		1.0 / (double)atlas->height
-	};
-
-	i = 0;
-	while (glyph) {
-		if (pen_x + glyph->bitmap.width + padding > atlas->width) {
-			/* Start a new line */
-			pen_x = padding;
-			pen_y += line_height + padding;
-	 		line_height = 0;
+
+	for (i = 0; i < face->num_fixed_sizes; i++)
+		if ((face->available_sizes[i].y_ppem + 32) >> 6 == size)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Raster all runes at the k-th render size into individual bitmaps and
+ * gather metrics. Every face of the fallback chain is set to the same
+ * pixel size so that their metrics share a common scale. Header metrics
+ * are those of the primary face.
+ * Returns 0 or 1 if the context failed.
+ */
+int rasterize_size(struct raster_context *ctx, int k, const struct fr *fr)
+{
+	int size = fr->pixel_heights[k];
+	const range_t *range;
+	int i, v;
+
+	for (i = 0; i < ctx->num_faces; i++) {
+		if (FT_Set_Pixel_Sizes(ctx->faces[i], 0, size)) {
+			raster_fail(ctx, "unable to set font size %d", size);
+			return 1;
+		}
+		ctx->use_strike[i] = ctx->embedded_bitmaps &&
+				     has_strike(ctx->faces[i], size);
+	}
+	ctx->num_embedded = 0;
+	ctx->num_outlines = 0;
+
+	for (v = 0; v < ctx->num_variants; v++) {
+		struct size_group *group = &ctx->groups[v * ctx->num_sizes + k];
+		group->pixel_height = size;
+		group->space_advance = space_advance(ctx->faces[0], size);
+		group->height = (float)ctx->faces[0]->height / (64.0f * (float)size);
+		group->phases = ctx->phases;
+	}
+
+	for (range = fr->ranges; range && !ctx->failure[0]; range = range->next)
+		rasterize_runes(ctx, k, range, fr);
+	for (i = 0; i < fr->num_strings && !ctx->failure[0]; i++)
+		rasterize_string(ctx, k, i, fr->strings[i], fr);
+	if (ctx->failure[0])
+		return 1;
+
+	if (fr->option_verbose && ctx->embedded_bitmaps)
+		printf("%dpx: %d glyphs from embedded bitmaps, %d from outlines\n",
+		       size, ctx->num_embedded, ctx->num_outlines);
+
+	return 0;
+}
+
+/*
+ * Returns path with a suffix inserted before its extension, eg. "a.png"
+ * with suffix "sdf" gives "a-sdf.png", or NULL when out of memory.
+ */
+char *suffixed_filename(const char *path, const char *suffix)
+{
+	const char *slash = strrchr(path, '/');
+	const char *dot = strrchr(path, '.');
+	size_t len = strlen(path);
+	char *s;
+
+	if (!dot || (slash && dot < slash))
+		dot = path + len;
+
+	s = malloc(len + strlen(suffix) + 2);
+	if (s)
+		sprintf(s, "%.*s-%s%s", (int)(dot - path), path, suffix, dot);
+
+	return s;
+}
+
+/* Returns the output file name of a variant */
+char *variant_filename(const char *path, int variant)
+{
+	return suffixed_filename(path, variant_name(variant));
+}
+
+/* Returns how output files of the run are to be written */
+int output_flags(const struct fr *fr)
+{
+	return (fr->if_changed ? OUTPUT_IF_CHANGED : 0) |
+	       (fr->option_verbose ? OUTPUT_VERBOSE : 0);
+}
+
+/* Returns the file name of an atlas page, the first one being path */
+char *page_filename(const char *path, int page)
+{
+	char suffix[16];
+	char *s;
+
+	if (!page) {
+		s = strdup(path);
+		if (!s)
+			die("out of memory");
+		return s;
+	}
+
+	snprintf(suffix, sizeof(suffix), "%d", page);
+	s = suffixed_filename(path, suffix);
+	if (!s)
+		die("out of memory");
+	return s;
+}
+
+/*
+ * Packs the glyph boxes on as many pages of the atlas size as needed.
+ * Returns the number of pages, glyphs larger than a page are counted in
+ * oversized.
+ */
+static int pack_pages(struct raster_glyph *glyph, int width, int height,
+		      int padding, int *oversized)
+{
+	struct packer packer;
+	int pages = 1;
+
+	*oversized = 0;
+	packer_init(&packer, width, height, padding);
+	for (; glyph; glyph = glyph->next) {
+		if (glyph->bitmap.width + padding * 2 > width ||
+		    glyph->bitmap.height + padding * 2 > height) {
+			(*oversized)++;
 			continue;
 		}
-		if (pen_y + glyph->bitmap.height + padding > atlas->height) {
-			/* Bitmap is too small */
-			break;
+		if (packer_place(&packer, glyph)) {
+			packer_init(&packer, width, height, padding);
+			packer_place(&packer, glyph);
+			pages++;
 		}
+	}
 
-		if (glyph->bitmap.height > line_height)
-			line_height = glyph->bitmap.height;
+	return pages;
+}
 
-		/* Blit the glyph into the atlas and free its pixels. */
-		bitmap_blit(atlas, &glyph->bitmap, pen_x, pen_y);
-		bitmap_free_pixels(&glyph->bitmap);
+/*
+ * Reports the atlas budget of each variant from the glyph boxes alone:
+ * the pages of the requested size, their fill ratio, the height needed
+ * to fit everything at the requested width and the smallest power of
+ * two square holding every glyph.
+ */
+static void report_dry_run(struct raster_context *ctx, const struct fr *fr)
+{
+	const struct raster_glyph *glyph;
+	int v;
 
-		/* Build texture coordinates according to atlas scale. */
-		double st0[2];
-		double st1[2];
+	for (v = 0; v < ctx->num_variants; v++) {
+		long area = 0;
+		int pages, oversized, square, needed_height = 0;
 
-		struct glyph_metrics *metrics = &glyph->metrics;
-		st0[0] = (double)pen_x;
-		st0[1] = (double)pen_y;
-		st1[0] = (double)(pen_x + glyph->bitmap.width);
-		st1[1] = (double)(pen_y + glyph->bitmap.height);
+		for (glyph = ctx->glyphs[v]; glyph; glyph = glyph->next)
+			area += (long)glyph->bitmap.width * glyph->bitmap.height;
 
-		metrics->st0[0] = st0[0] * atlas_scale[0];
-		metrics->st0[1] = st0[1] * atlas_scale[1];
-		metrics->st1[0] = st1[0] * atlas_scale[0];
-		metrics->st1[1] = st1[1] * atlas_scale[1];
+		pages = pack_pages(ctx->glyphs[v], fr->atlas_width,
+				   fr->atlas_height, fr->padding, &oversized);
 
-#if 0
-		printf("glyph index:%d, rune:%04x\n", i, glyph->rune);
-		printf("advance (%f, %f) ", metrics->advance[0], metrics->advance[1]);
-		printf("bearing (%f, %f) ", metrics->bearing[0], metrics->bearing[1]);
-		printf("size (%f, %f)\n", metrics->size[0], metrics->size[1]);
-		printf("(float) st0 (%f, %f), st1 (%f, %f)\n", s0, t0, s1, t1);
-		printf("(uint16_t) st0 (%04x, %04x), st1 (%04x, %04x)\n",
-		       metrics->s0, metrics->t0, metrics->s1, metrics->t1);
-#endif
+		if (pack_glyphs(ctx->glyphs[v], fr->atlas_width, INT_MAX,
+				fr->padding) == ctx->num_glyphs[v]) {
+			for (glyph = ctx->glyphs[v]; glyph; glyph = glyph->next)
+				if (glyph->y + glyph->bitmap.height + fr->padding > needed_height)
+					needed_height = glyph->y + glyph->bitmap.height + fr->padding;
+		}
 
-		pen_x += glyph->bitmap.width + padding;
-		glyph = glyph->next;
-		i++;
+		for (square = 1; square <= MAX_DRY_RUN_SQUARE; square *= 2)
+			if (pack_glyphs(ctx->glyphs[v], square, square,
+					fr->padding) == ctx->num_glyphs[v])
+				break;
+
+		printf("%s: glyphs=%d pixels=%ld atlas=%dx%d pages=%d fill=%.3f "
+		       "oversized=%d needed_height=%d square=%d\n",
+		       variant_name(ctx->variants[v]), ctx->num_glyphs[v], area,
+		       fr->atlas_width, fr->atlas_height, pages,
+		       (double)area / ((double)pages * fr->atlas_width *
+				       fr->atlas_height),
+		       oversized, needed_height,
+		       square <= MAX_DRY_RUN_SQUARE ? square : 0);
 	}
+}
 
-	return i;
-};
+/* Counts the glyphs of every variant and those placed in their atlas */
+static void count_glyphs(const struct raster_context *ctx,
+			 struct raster_stats *stats)
+{
+	const struct raster_glyph *glyph;
+	int v;
+
+	memset(stats, 0, sizeof(*stats));
+	for (v = 0; v < ctx->num_variants; v++) {
+		stats->num_glyphs += ctx->num_glyphs[v];
+		for (glyph = ctx->glyphs[v]; glyph; glyph = glyph->next)
+			if (glyph->x >= 0)
+				stats->num_placed++;
+	}
+}
 
-void rasterize_font(FT_Face face, const struct fr *fr)
+/*
+ * Rasterizes the runes of every size into atlases and metrics, as per
+ * the options.
+ * Returns 0 or 1 if the rasterization failed, the reason being left in
+ * the stats.
+ */
+int rasterize_font(FT_Face *faces, int num_faces, const struct fr *fr)
 {
+	struct raster_context ctx;
 	struct bitmap *atlas = NULL;
-	struct raster_glyph *glyphs = NULL;
-	int num_glyphs = 0;
+	int i, k, v;
 
-	/*
-	 * Raster all runes into individual bitmaps and gather metrics.
-	 */
-	const range_t *range;
-	for (range = fr->ranges; range; range = range->next)
-		rasterize_runes(face, &glyphs, &num_glyphs, range, fr);
+	if (fr->curves_filename) {
+		export_curves(faces, num_faces, fr);
+		return 0;
+	}
 
-	/*
-	 * Build the atlas texture from the rasterized glyphs and fill the
-	 * texture coordinates.
-	 */
-	atlas = create_bitmap(fr->atlas_width, fr->atlas_height);
-	fill_atlas_and_metrics(atlas, glyphs, fr->padding);
+	if (raster_context_init(&ctx, faces, num_faces, fr))
+		goto done;
+
+	if (fr->dry_run) {
+		for (k = 0; k < fr->num_sizes; k++)
+			if (rasterize_size(&ctx, k, fr))
+				goto done;
+		report_dry_run(&ctx, fr);
+		goto done;
+	}
+
+	if (fr->append) {
+		rasterize_font_appended(&ctx, fr);
+		goto done;
+	}
+
+	if (fr->pipeline) {
+		rasterize_font_pipelined(&ctx, fr);
+		goto done;
+	}
+
+	for (k = 0; k < fr->num_sizes; k++)
+		if (rasterize_size(&ctx, k, fr))
+			goto done;
 
 	/*
-	 * Now the atlas has been filled and we know the glyph texture
-	 * coordinates, we can proceed and write the files.
+	 * Pack the glyphs of each variant, unless an already packed
+	 * variant has the very same glyph boxes.
 	 */
-	write_atlas(atlas, fr->atlas_filename);
-	write_metrics(face, glyphs, num_glyphs, fr->pixel_height, fr->metrics_filename, fr->format);
+	for (v = 0; v < ctx.num_variants; v++) {
+		for (i = 0; i < v; i++)
+			if (!share_packing(ctx.glyphs[v], ctx.glyphs[i]))
+				break;
+		if (i == v)
+			pack_glyphs(ctx.glyphs[v], fr->atlas_width,
+				    fr->atlas_height, fr->padding);
+		else if (fr->option_verbose)
+			printf("variant %s shares packing with %s\n",
+			       variant_name(ctx.variants[v]),
+			       variant_name(ctx.variants[i]));
+	}
+
+	for (v = 0; v < ctx.num_variants && !ctx.failure[0]; v++) {
+		char *atlas_filename = fr->atlas_filename;
+		char *metrics_filename = fr->metrics_filename;
+
+		if (fr->num_variants) {
+			atlas_filename = variant_filename(atlas_filename, ctx.variants[v]);
+			metrics_filename = variant_filename(metrics_filename, ctx.variants[v]);
+		}
 
-	/* Free atlas and glyph list */
-	destroy_bitmap(atlas);
-	while (glyphs) {
-		struct raster_glyph *next = glyphs->next;
-		free(glyphs);
-		glyphs = next;
+		/*
+		 * Build the atlas texture from the rasterized glyphs and
+		 * fill the texture coordinates.
+		 */
+		atlas = NULL;
+		if (atlas_filename && metrics_filename)
+			atlas = create_tiled_bitmap(fr->atlas_width, fr->atlas_height,
+						    fr->tile_size, ctx.effects.channels);
+		if (!atlas) {
+			raster_fail(&ctx, "out of memory");
+			goto next;
+		}
+		fill_atlas_and_metrics(atlas, ctx.glyphs[v]);
+		if (atlas->failed) {
+			destroy_bitmap(atlas);
+			raster_fail(&ctx, "out of memory");
+			goto next;
+		}
+		if (fr->option_verbose && atlas->tile_size) {
+			int allocated, count = bitmap_tile_count(atlas, &allocated);
+			printf("%d of %d atlas tiles allocated\n", allocated, count);
+		}
+
+		/*
+		 * Now the atlas has been filled and we know the glyph texture
+		 * coordinates, we can proceed and write the files.
+		 */
+		if (write_atlas(atlas, atlas_filename, output_flags(fr)))
+			raster_fail(&ctx, "writing %s", atlas_filename);
+		else if (write_metrics(&ctx.groups[v * ctx.num_sizes], ctx.num_sizes,
+				       metrics_filename, fr->formats, output_flags(fr)))
+			raster_fail(&ctx, "writing %s", metrics_filename);
+		destroy_bitmap(atlas);
+
+		if (fr->option_verbose && !ctx.failure[0])
+			printf("%d glyphs rasterized to atlas %s\n",
+			       ctx.num_glyphs[v], atlas_filename);
+		if (fr->option_verbose && ctx.phases > 1 && !ctx.failure[0])
+			printf("%d subpixel phases share the pixels of another\n",
+			       ctx.num_shared[v]);
+
+next:
+		if (fr->num_variants) {
+			free(atlas_filename);
+			free(metrics_filename);
+		}
+	}
+
+	if (fr->option_verbose && !ctx.failure[0])
+		printf("Done.\n");
+
+done:
+	if (fr->stats) {
+		count_glyphs(&ctx, fr->stats);
+		strcpy(fr->stats->failure, ctx.failure);
 	}
 
-	if (fr->option_verbose)
-		printf("%d glyphs rasterized to atlas\nDone.\n", num_glyphs);
+	/* Free glyph lists */
+	raster_context_done(&ctx);
+
+	return ctx.failure[0] != 0;
 }
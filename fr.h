@@ -3,6 +3,8 @@
 
 #include "bitmap.h"
 #include <stdint.h>
+#include <stdio.h>
+#include <png.h>
 
 typedef struct rune_range {
 	uint32_t lo;
@@ -10,32 +12,302 @@ typedef struct rune_range {
 	struct rune_range *next;
 } range_t;
 
+/*
+ * A font face of the fallback chain. index selects the face inside a
+ * font collection (.ttc/.otc), it is 0 for regular font files.
+ */
+typedef struct font_face {
+	char *filename;
+	int index;
+	struct font_face *next;
+} face_t;
+
 #define MF_TEXT (0)
 #define MF_BINARY (1)
+#define MF_CSV (2)
+#define MF_JSON (3)
+#define MF_COUNT (4)
+
+/* Rendering variants */
+#define RV_NORMAL (0) /* antialiased coverage */
+#define RV_MONO (1) /* 1 bit coverage */
+#define RV_SDF (2) /* signed distance field */
+#define RV_COUNT (3)
+
+/* Subpixel phases are stored on a byte, and outlines move by 1/64 px. */
+#define MAX_PHASES (64)
+
+/* Outcome of the rasterization of a font */
+struct raster_stats {
+	int num_glyphs; /* of every variant */
+	int num_placed; /* glyphs which made it into the atlas */
+	char failure[128]; /* why it failed, empty if it did not */
+};
 
 struct fr {
 	/* Options */
 	char *atlas_filename;
 	char *metrics_filename;
-	char *font_filename;
+	face_t *faces; /* fallback chain, in command line order */
+	int num_faces;
 	int option_verbose;
-	int format;
+	int format; /* first metrics format, names the default file */
+	int formats; /* mask of the metrics formats to write */
 	int atlas_width;
 	int atlas_height;
-	int pixel_height;
+	int *pixel_heights; /* render sizes, all packed in the same atlas */
+	int num_sizes;
 	int padding; /* padding between glyphs in pixel */
 	int border; /* border around glyph (considered part of the glyph) */
 	int no_antialias; /* border around glyph (considered part of the glyph) */
+	int variants[RV_COUNT]; /* variants rendered from each loaded glyph */
+	int num_variants; /* 0 unless several variants were requested */
+	int pipeline; /* stream glyphs through concurrent stages */
+	int embedded_bitmaps; /* use bitmap strikes matching the render size */
+	int append; /* extend the existing atlas and binary metrics */
+	int tile_size; /* store atlases as tiles of this size, 0 for rows */
+	int phases; /* horizontal subpixel phases rendered per glyph */
+	int outline; /* radius of the baked outline, 0 for none */
+	float shadow; /* deviation of the baked shadow blur, 0 for none */
+	int shadow_offset[2];
+	char *curves_filename; /* export outlines as curves instead */
+	int dry_run; /* only report the atlas budget from glyph boxes */
+	int if_changed; /* leave outputs identical to the existing files */
 	range_t *ranges;
+	char **strings; /* UTF-8 strings rendered as single sprites */
+	int num_strings;
+	int sweep; /* rasterize every font of sweep_dir */
+	char *sweep_dir;
+	char *sweep_output; /* directory of the outputs of each font */
+	int jobs; /* sweep workers */
 
 	/* State information */
 	const char *progname;
 	char **argv;
 	int argc;
 	int return_value;
+	struct raster_stats *stats; /* filled when not NULL */
 };
 
+/* struct holding a glyph metrics */
+struct glyph_metrics {
+	float bearing[2];
+	float advance[2];
+	float size[2];
+
+	double st0[2];
+	double st1[2];
+
+	int face; /* index of the source face in the fallback chain */
+	int page; /* atlas page holding the glyph */
+	int phase; /* outline moved right by phase / phases pixel */
+};
+
+struct raster_glyph {
+	struct raster_glyph *next;
+
+	uint32_t rune;
+	struct bitmap bitmap;
+	struct glyph_metrics metrics;
+	int x, y; /* position in the atlas, negative if not placed */
+	const struct raster_glyph *shared; /* earlier glyph with the same pixels */
+};
+
+/* Glyphs rendered at one pixel size, along with their header metrics. */
+struct size_group {
+	int pixel_height;
+	float space_advance;
+	float height;
+	int phases; /* subpixel phases of each rune */
+	struct raster_glyph *glyphs; /* first glyph of the group */
+	int num_glyphs;
+};
+
+/* Effect channels baked next to the coverage of every glyph */
+struct effects {
+	int outline; /* dilation radius in pixels, 0 for none */
+	float shadow; /* gaussian deviation in pixels, 0 for none */
+	int shadow_offset[2]; /* in pixels, right and down */
+	int shadow_radius; /* of the gaussian kernel */
+	float *kernel;
+	int channels; /* coverage, then outline and shadow when on */
+	int margin; /* added around glyph boxes to hold the effects */
+};
+
+/*
+ * State of the rasterization of a font, shared by every render size.
+ * Glyphs of each variant are appended to a single list, in rune order,
+ * each size group pointing to its first glyph.
+ */
+struct raster_context {
+	FT_Face *faces;
+	int num_faces;
+	int variants[RV_COUNT];
+	int num_variants;
+	int phases;
+	struct effects effects;
+	struct size_group *groups; /* groups[v * num_sizes + k] */
+	int num_sizes;
+	struct raster_glyph *glyphs[RV_COUNT];
+	struct raster_glyph **tails[RV_COUNT];
+	int num_glyphs[RV_COUNT];
+	int num_shared[RV_COUNT]; /* phases using the pixels of another */
+	int *use_strike; /* per face, for the current render size */
+	int dry_run; /* glyphs only get their box, without pixels */
+	int embedded_bitmaps; /* embedded strikes are allowed */
+	int num_embedded; /* glyphs loaded from a strike at the current size */
+	int num_outlines; /* glyphs loaded from their outline */
+	char failure[128]; /* first error met, empty if none */
+
+	/* Called for every glyph once it joined its group, may be NULL */
+	void (*emit)(struct raster_glyph *glyph, int variant, void *data);
+	void *emit_data;
+
+	/* Returns whether to leave a rune out of size k, may be NULL */
+	int (*skip_rune)(uint32_t rune, int k, void *data);
+	void *skip_data;
+};
+
+/* Online line packer */
+struct packer {
+	int width;
+	int height;
+	int padding;
+	int pen_x;
+	int pen_y; /* rows above are final */
+	int line_height;
+	int full;
+};
+
+struct rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/*
+ * Free space of an atlas page as a list of maximal free rectangles, each
+ * glyph occupying its box plus the padding on its right and bottom.
+ */
+struct space_map {
+	struct rect *free;
+	int count;
+	int capacity;
+	int padding;
+};
+
+/* Output file, see output.c */
+#define OUTPUT_IF_CHANGED (1 << 0) /* leave identical files untouched */
+#define OUTPUT_VERBOSE (1 << 1) /* tell about untouched files */
+
+struct output {
+	FILE *fp;
+	char *path;
+	char *tmp_path; /* NULL when written in place */
+	int flags;
+	uint64_t hash;
+	uint64_t size;
+	int failed;
+	int unchanged; /* the existing file was kept */
+};
+
+/* Atlas png file written by bands of rows */
+struct png_stream {
+	struct output out;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	int width;
+	int height;
+	int failed;
+	uint8_t *rows; /* rows gathered from a tiled bitmap */
+};
+
+/* Output file written by large chunks */
+struct outbuf {
+	struct output file;
+	char *data;
+	size_t len;
+	size_t capacity;
+	int failed;
+};
+
+/* options.c */
 void parse_options(struct fr *fr);
-void rasterize_font(FT_Face face, const struct fr *fr);
+const char *variant_name(int variant);
+
+/* fr.c */
+int resolve_rune(FT_Face *faces, int num_faces, uint32_t rune,
+		 FT_UInt *glyph_index);
+int raster_context_init(struct raster_context *ctx, FT_Face *faces,
+			int num_faces, const struct fr *fr);
+void raster_context_done(struct raster_context *ctx);
+void raster_fail(struct raster_context *ctx, const char *fmt, ...);
+int has_strike(FT_Face face, int size);
+int rasterize_size(struct raster_context *ctx, int k, const struct fr *fr);
+char *suffixed_filename(const char *path, const char *suffix);
+char *variant_filename(const char *path, int variant);
+char *page_filename(const char *path, int page);
+int output_flags(const struct fr *fr);
+int rasterize_font(FT_Face *faces, int num_faces, const struct fr *fr);
+
+/* atlas.c */
+void packer_init(struct packer *packer, int width, int height, int padding);
+int packer_place(struct packer *packer, struct raster_glyph *glyph);
+int pack_glyphs(struct raster_glyph *glyph, int atlas_width, int atlas_height,
+		int padding);
+int share_packing(struct raster_glyph *dst, const struct raster_glyph *src);
+void blit_glyph(struct bitmap *atlas, struct raster_glyph *glyph);
+void fill_atlas_and_metrics(struct bitmap *atlas, struct raster_glyph *glyph);
+void space_map_init(struct space_map *map, int width, int height, int padding);
+void space_map_done(struct space_map *map);
+void space_map_occupy(struct space_map *map, int x, int y, int width, int height);
+int space_map_place(struct space_map *map, struct raster_glyph *glyph);
+int png_stream_open(struct png_stream *ps, const char *filename,
+		    int width, int height, int channels, int flags);
+void png_stream_rows(struct png_stream *ps, const struct bitmap *bp,
+		     int y0, int y1);
+int png_stream_close(struct png_stream *ps);
+int write_atlas(const struct bitmap *bp, const char *filename, int flags);
+struct bitmap *read_atlas(const char *filename);
+
+/* metrics.c */
+const char *metrics_extension(int format);
+int write_metrics(const struct size_group *groups, int num_groups,
+		  const char *path, int formats, int flags);
+struct size_group *read_metrics(const char *path, int *num_groups);
+
+/* append.c */
+void rasterize_font_appended(struct raster_context *ctx, const struct fr *fr);
+
+/* pipeline.c */
+void rasterize_font_pipelined(struct raster_context *ctx, const struct fr *fr);
+
+/* output.c */
+int output_open(struct output *o, const char *path, int flags);
+void output_write(struct output *o, const void *data, size_t size);
+int output_close(struct output *o);
+
+/* outbuf.c */
+int outbuf_open(struct outbuf *out, const char *path, int flags);
+int outbuf_close(struct outbuf *out);
+void outbuf_write(struct outbuf *out, const void *data, size_t size);
+void outbuf_puts(struct outbuf *out, const char *s);
+void outbuf_putc(struct outbuf *out, char c);
+void outbuf_uint(struct outbuf *out, unsigned long v);
+void outbuf_int(struct outbuf *out, long v);
+void outbuf_float(struct outbuf *out, float v);
+void outbuf_utf8(struct outbuf *out, uint32_t rune);
+
+/* effects.c */
+int effects_init(struct effects *e, const struct fr *fr);
+void effects_done(struct effects *e);
+int apply_effects(const struct effects *e, struct bitmap *bp);
+
+/* sweep.c */
+int sweep_fonts(const struct fr *fr);
+
+/* curves.c */
+void export_curves(FT_Face *faces, int num_faces, const struct fr *fr);
 
 #endif /* FR_H */
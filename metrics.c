@@ -0,0 +1,483 @@
+#include "fr.h"
+#include "raster_font.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Metrics are written in a single pass over the glyphs by one emitter
+ * per requested format, each filling its own output buffer.
+ */
+struct metrics_writer {
+	const struct metrics_emitter *emitter;
+	struct outbuf out;
+	char *path;
+	uint32_t offset; /* binary file offset of the next group */
+};
+
+struct metrics_emitter {
+	const char *extension;
+	void (*begin)(struct metrics_writer *w);
+	void (*group)(struct metrics_writer *w, const struct size_group *group,
+		      int index, int last);
+	void (*glyph)(struct metrics_writer *w, const struct size_group *group,
+		      const struct raster_glyph *glyph, int index);
+	void (*group_end)(struct metrics_writer *w);
+	void (*end)(struct metrics_writer *w);
+};
+
+/* Runes printable as such, control characters and sprites are not. */
+static int printable_rune(uint32_t rune)
+{
+	return !(rune & STRING_RUNE_FLAG) && rune >= 0x20 &&
+	       !(rune >= 0x7F && rune < 0xA0);
+}
+
+static void put_field(struct outbuf *out, const char *name, float v)
+{
+	outbuf_puts(out, name);
+	outbuf_float(out, v);
+	outbuf_putc(out, '\n');
+}
+
+static void text_group(struct metrics_writer *w, const struct size_group *group,
+		       int index, int last)
+{
+	struct outbuf *out = &w->out;
+
+	if (index)
+		outbuf_putc(out, '\n');
+	outbuf_puts(out, "glyph_count=");
+	outbuf_int(out, group->num_glyphs);
+	outbuf_puts(out, "\nrender_size=");
+	outbuf_int(out, group->pixel_height);
+	outbuf_putc(out, '\n');
+	if (group->phases > 1) {
+		outbuf_puts(out, "phases=");
+		outbuf_int(out, group->phases);
+		outbuf_putc(out, '\n');
+	}
+	put_field(out, "space_advance=", group->space_advance);
+	put_field(out, "height=", group->height);
+}
+
+static void text_glyph(struct metrics_writer *w, const struct size_group *group,
+		       const struct raster_glyph *glyph, int index)
+{
+	const struct glyph_metrics *metrics = &glyph->metrics;
+	struct outbuf *out = &w->out;
+
+	outbuf_puts(out, "\n# Glyph ");
+	outbuf_int(out, index);
+	outbuf_puts(out, " (");
+	if (glyph->rune & STRING_RUNE_FLAG) {
+		/* String sprites are named after their index */
+		outbuf_puts(out, "string ");
+		outbuf_uint(out, glyph->rune & ~STRING_RUNE_FLAG);
+	} else if (printable_rune(glyph->rune)) {
+		outbuf_utf8(out, glyph->rune);
+	}
+	outbuf_puts(out, ")\nrune=");
+	outbuf_uint(out, glyph->rune);
+	outbuf_puts(out, "\nface=");
+	outbuf_int(out, metrics->face);
+	outbuf_putc(out, '\n');
+	if (group->phases > 1) {
+		outbuf_puts(out, "phase=");
+		outbuf_int(out, metrics->phase);
+		outbuf_putc(out, '\n');
+	}
+	put_field(out, "horizontal_bearing=", metrics->bearing[0]);
+	put_field(out, "vertical_bearing=", metrics->bearing[1]);
+	put_field(out, "horizontal_advance=", metrics->advance[0]);
+	put_field(out, "vertical_advance=", metrics->advance[1]);
+	put_field(out, "width=", metrics->size[0]);
+	put_field(out, "height=", metrics->size[1]);
+	put_field(out, "s0=", metrics->st0[0]);
+	put_field(out, "t0=", metrics->st0[1]);
+	put_field(out, "s1=", metrics->st1[0]);
+	put_field(out, "t1=", metrics->st1[1]);
+}
+
+static void binary_group(struct metrics_writer *w, const struct size_group *group,
+			 int index, int last)
+{
+	const struct raster_glyph *glyph;
+	struct metrics_hdr def;
+	int n;
+
+	def.glyph_count = group->num_glyphs;
+	def.space_advance = group->space_advance;
+	def.lut_offset = w->offset + sizeof(struct metrics_hdr);
+	def.glyph_offset = def.lut_offset + sizeof(uint32_t) * group->num_glyphs;
+	def.render_size = group->pixel_height;
+	def.height = group->height;
+	w->offset = def.glyph_offset + sizeof(struct glyph_def) * group->num_glyphs;
+	def.next_offset = last ? 0 : w->offset;
+	outbuf_write(&w->out, &def, sizeof(def));
+
+	glyph = group->glyphs;
+	for (n = 0; n < group->num_glyphs; n++, glyph = glyph->next)
+		outbuf_write(&w->out, &glyph->rune, sizeof(uint32_t));
+}
+
+static void binary_glyph(struct metrics_writer *w, const struct size_group *group,
+			 const struct raster_glyph *glyph, int index)
+{
+	const struct glyph_metrics *metrics = &glyph->metrics;
+	struct glyph_def m;
+
+	m.bearing[0] = metrics->bearing[0];
+	m.bearing[1] = metrics->bearing[1];
+	m.advance[0] = metrics->advance[0];
+	m.advance[1] = metrics->advance[1];
+	m.size[0] = metrics->size[0];
+	m.size[1] = metrics->size[1];
+	m.st0[0] = metrics->st0[0] * (double)UINT16_MAX;
+	m.st0[1] = metrics->st0[1] * (double)UINT16_MAX;
+	m.st1[0] = metrics->st1[0] * (double)UINT16_MAX;
+	m.st1[1] = metrics->st1[1] * (double)UINT16_MAX;
+	m.face = metrics->face;
+	m.page = metrics->page;
+	m.phase = metrics->phase;
+	m.reserved = 0;
+
+	outbuf_write(&w->out, &m, sizeof(m));
+}
+
+static void csv_begin(struct metrics_writer *w)
+{
+	outbuf_puts(&w->out, "render_size,rune,char,face,page,phase,"
+		    "horizontal_bearing,vertical_bearing,"
+		    "horizontal_advance,vertical_advance,width,height,"
+		    "s0,t0,s1,t1\n");
+}
+
+static void csv_field(struct outbuf *out, float v)
+{
+	outbuf_putc(out, ',');
+	outbuf_float(out, v);
+}
+
+static void csv_glyph(struct metrics_writer *w, const struct size_group *group,
+		      const struct raster_glyph *glyph, int index)
+{
+	const struct glyph_metrics *metrics = &glyph->metrics;
+	struct outbuf *out = &w->out;
+
+	outbuf_int(out, group->pixel_height);
+	outbuf_putc(out, ',');
+	outbuf_uint(out, glyph->rune);
+	outbuf_puts(out, ",\"");
+	if (glyph->rune == '"')
+		outbuf_puts(out, "\"\"");
+	else if (printable_rune(glyph->rune))
+		outbuf_utf8(out, glyph->rune);
+	outbuf_puts(out, "\",");
+	outbuf_int(out, metrics->face);
+	outbuf_putc(out, ',');
+	outbuf_int(out, metrics->page);
+	outbuf_putc(out, ',');
+	outbuf_int(out, metrics->phase);
+	csv_field(out, metrics->bearing[0]);
+	csv_field(out, metrics->bearing[1]);
+	csv_field(out, metrics->advance[0]);
+	csv_field(out, metrics->advance[1]);
+	csv_field(out, metrics->size[0]);
+	csv_field(out, metrics->size[1]);
+	csv_field(out, metrics->st0[0]);
+	csv_field(out, metrics->st0[1]);
+	csv_field(out, metrics->st1[0]);
+	csv_field(out, metrics->st1[1]);
+	outbuf_putc(out, '\n');
+}
+
+static void json_begin(struct metrics_writer *w)
+{
+	outbuf_puts(&w->out, "{\"sizes\":[");
+}
+
+static void json_group(struct metrics_writer *w, const struct size_group *group,
+		       int index, int last)
+{
+	struct outbuf *out = &w->out;
+
+	if (index)
+		outbuf_putc(out, ',');
+	outbuf_puts(out, "\n{\"render_size\":");
+	outbuf_int(out, group->pixel_height);
+	outbuf_puts(out, ",\"space_advance\":");
+	outbuf_float(out, group->space_advance);
+	outbuf_puts(out, ",\"height\":");
+	outbuf_float(out, group->height);
+	if (group->phases > 1) {
+		outbuf_puts(out, ",\"phases\":");
+		outbuf_int(out, group->phases);
+	}
+	outbuf_puts(out, ",\"glyphs\":[");
+}
+
+static void json_pair(struct outbuf *out, const char *name, float x, float y)
+{
+	outbuf_puts(out, name);
+	outbuf_float(out, x);
+	outbuf_putc(out, ',');
+	outbuf_float(out, y);
+	outbuf_putc(out, ']');
+}
+
+static void json_glyph(struct metrics_writer *w, const struct size_group *group,
+		       const struct raster_glyph *glyph, int index)
+{
+	const struct glyph_metrics *metrics = &glyph->metrics;
+	struct outbuf *out = &w->out;
+	uint32_t rune = glyph->rune;
+
+	if (index)
+		outbuf_putc(out, ',');
+	outbuf_puts(out, "\n{\"rune\":");
+	outbuf_uint(out, rune);
+	if (rune & STRING_RUNE_FLAG) {
+		outbuf_puts(out, ",\"string\":");
+		outbuf_uint(out, rune & ~STRING_RUNE_FLAG);
+	} else if (printable_rune(rune)) {
+		outbuf_puts(out, ",\"char\":\"");
+		if (rune == '"' || rune == '\\')
+			outbuf_putc(out, '\\');
+		outbuf_utf8(out, rune);
+		outbuf_putc(out, '"');
+	}
+	outbuf_puts(out, ",\"face\":");
+	outbuf_int(out, metrics->face);
+	outbuf_puts(out, ",\"page\":");
+	outbuf_int(out, metrics->page);
+	if (group->phases > 1) {
+		outbuf_puts(out, ",\"phase\":");
+		outbuf_int(out, metrics->phase);
+	}
+	json_pair(out, ",\"bearing\":[", metrics->bearing[0], metrics->bearing[1]);
+	json_pair(out, ",\"advance\":[", metrics->advance[0], metrics->advance[1]);
+	json_pair(out, ",\"size\":[", metrics->size[0], metrics->size[1]);
+	json_pair(out, ",\"st0\":[", metrics->st0[0], metrics->st0[1]);
+	json_pair(out, ",\"st1\":[", metrics->st1[0], metrics->st1[1]);
+	outbuf_putc(out, '}');
+}
+
+static void json_group_end(struct metrics_writer *w)
+{
+	outbuf_puts(&w->out, "]}");
+}
+
+static void json_end(struct metrics_writer *w)
+{
+	outbuf_puts(&w->out, "\n]}\n");
+}
+
+static const struct metrics_emitter emitters[MF_COUNT] = {
+	[MF_TEXT] = { "txt", NULL, text_group, text_glyph, NULL, NULL },
+	[MF_BINARY] = { "bin", NULL, binary_group, binary_glyph, NULL, NULL },
+	[MF_CSV] = { "csv", csv_begin, NULL, csv_glyph, NULL, NULL },
+	[MF_JSON] = { "json", json_begin, json_group, json_glyph,
+		      json_group_end, json_end },
+};
+
+const char *metrics_extension(int format)
+{
+	return emitters[format].extension;
+}
+
+/*
+ * Returns path with its extension replaced by the one of the format, or
+ * NULL when out of memory.
+ */
+static char *format_filename(const char *path, int format)
+{
+	const char *slash = strrchr(path, '/');
+	const char *dot = strrchr(path, '.');
+	const char *ext = emitters[format].extension;
+	char *s;
+
+	if (!dot || (slash && dot < slash))
+		dot = path + strlen(path);
+
+	s = malloc((dot - path) + strlen(ext) + 2);
+	if (s)
+		sprintf(s, "%.*s.%s", (int)(dot - path), path, ext);
+
+	return s;
+}
+
+/*
+ * Writes the metrics of the groups in every format of the mask. A single
+ * format is written to path, several ones each to path with the
+ * extension of the format.
+ * Returns 0 or 1 if any file could not be written.
+ */
+int write_metrics(const struct size_group *groups, int num_groups,
+		  const char *path, int formats, int flags)
+{
+	struct metrics_writer writers[MF_COUNT];
+	struct metrics_writer *w;
+	const struct raster_glyph *glyph;
+	int num_writers = 0, f, i, n, err = 0;
+
+	for (f = 0; f < MF_COUNT; f++) {
+		if (!(formats & (1 << f)))
+			continue;
+
+		w = &writers[num_writers];
+		w->emitter = &emitters[f];
+		w->offset = 0;
+		if (formats == (1 << f))
+			w->path = strdup(path);
+		else
+			w->path = format_filename(path, f);
+		if (!w->path || outbuf_open(&w->out, w->path, flags)) {
+			if (w->path)
+				warning("unable to open %s", w->path);
+			free(w->path);
+			err = 1;
+			break;
+		}
+		num_writers++;
+		if (w->emitter->begin)
+			w->emitter->begin(w);
+	}
+
+	/* Files already opened are closed as failed ones. */
+	if (err) {
+		for (w = writers; w < writers + num_writers; w++) {
+			w->out.file.failed = 1;
+			outbuf_close(&w->out);
+			free(w->path);
+		}
+		return 1;
+	}
+
+	for (i = 0; i < num_groups; i++) {
+		for (w = writers; w < writers + num_writers; w++)
+			if (w->emitter->group)
+				w->emitter->group(w, &groups[i], i,
+						  i == num_groups - 1);
+
+		glyph = groups[i].glyphs;
+		for (n = 0; n < groups[i].num_glyphs; n++, glyph = glyph->next)
+			for (w = writers; w < writers + num_writers; w++)
+				w->emitter->glyph(w, &groups[i], glyph, n);
+
+		for (w = writers; w < writers + num_writers; w++)
+			if (w->emitter->group_end)
+				w->emitter->group_end(w);
+	}
+
+	for (w = writers; w < writers + num_writers; w++) {
+		if (w->emitter->end)
+			w->emitter->end(w);
+		if (outbuf_close(&w->out)) {
+			warning("unable to write %s", w->path);
+			err = 1;
+		}
+		free(w->path);
+	}
+
+	return err;
+}
+
+/*
+ * Loads binary metrics written by a previous run. Glyphs of every size
+ * group are chained in file order and have no pixels. Texture
+ * coordinates are set halfway between two quantization steps so that
+ * writing them again gives the very same values.
+ * Returns NULL if the file can't be read or is not valid.
+ */
+struct size_group *read_metrics(const char *path, int *num_groups)
+{
+	struct size_group *groups = NULL;
+	struct raster_glyph **tail;
+	struct metrics_hdr hdr;
+	struct glyph_def def;
+	uint32_t rune, offset = 0;
+	long size;
+	FILE *fp;
+	int i, n = 0;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return NULL;
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+
+	do {
+		if (offset + sizeof(hdr) > size ||
+		    fseek(fp, offset, SEEK_SET) ||
+		    fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		    hdr.lut_offset + (uint64_t)hdr.glyph_count * sizeof(rune) > size ||
+		    hdr.glyph_offset + (uint64_t)hdr.glyph_count * sizeof(def) > size ||
+		    (hdr.next_offset && hdr.next_offset <= offset))
+			goto failure;
+
+		groups = realloc(groups, sizeof(struct size_group) * (n + 1));
+		if (!groups)
+			die("out of memory");
+		struct size_group *group = &groups[n++];
+		memset(group, 0, sizeof(*group));
+		group->pixel_height = hdr.render_size;
+		group->space_advance = hdr.space_advance;
+		group->height = hdr.height;
+		group->num_glyphs = hdr.glyph_count;
+		group->phases = 1;
+
+		tail = &group->glyphs;
+		for (i = 0; i < hdr.glyph_count; i++) {
+			struct raster_glyph *glyph = calloc(1, sizeof(*glyph));
+			if (!glyph)
+				die("out of memory");
+			*tail = glyph;
+			tail = &glyph->next;
+
+			if (fseek(fp, hdr.lut_offset + i * sizeof(rune), SEEK_SET) ||
+			    fread(&rune, sizeof(rune), 1, fp) != 1 ||
+			    fseek(fp, hdr.glyph_offset + i * sizeof(def), SEEK_SET) ||
+			    fread(&def, sizeof(def), 1, fp) != 1)
+				goto failure;
+
+			struct glyph_metrics *metrics = &glyph->metrics;
+			glyph->rune = rune;
+			memcpy(metrics->bearing, def.bearing, sizeof(def.bearing));
+			memcpy(metrics->advance, def.advance, sizeof(def.advance));
+			memcpy(metrics->size, def.size, sizeof(def.size));
+			metrics->st0[0] = (def.st0[0] + 0.5) / (double)UINT16_MAX;
+			metrics->st0[1] = (def.st0[1] + 0.5) / (double)UINT16_MAX;
+			metrics->st1[0] = (def.st1[0] + 0.5) / (double)UINT16_MAX;
+			metrics->st1[1] = (def.st1[1] + 0.5) / (double)UINT16_MAX;
+			metrics->face = def.face;
+			metrics->page = def.page;
+			metrics->phase = def.phase;
+			if (def.phase >= group->phases)
+				group->phases = def.phase + 1;
+			glyph->x = -1;
+			glyph->y = -1;
+		}
+
+		offset = hdr.next_offset;
+	} while (offset);
+
+	fclose(fp);
+	*num_groups = n;
+	return groups;
+
+failure:
+	fclose(fp);
+	for (i = 0; i < n; i++) {
+		while (groups[i].glyphs) {
+			struct raster_glyph *next = groups[i].glyphs->next;
+			free(groups[i].glyphs);
+			groups[i].glyphs = next;
+		}
+	}
+	free(groups);
+	return NULL;
+}
@@ -5,6 +5,7 @@
 #include <stddef.h> /* NULL */
 #include <stdlib.h> /* exit */
 #include <string.h>
+#include <unistd.h> /* sysconf */
 
 static const char *version = "0.1";
 
@@ -24,21 +25,69 @@ static char *mystrdup(const char *s)
 static void usage(const struct fr *fr)
 {
 	printf("Font rasterizer version %s\n", version);
-	printf("Usage: %s [options] font\n", fr->progname);
+	printf("Usage: %s [options] font[:<face>] [fallback font[:<face>]...]\n", fr->progname);
+	printf("       %s sweep [options] <font dir> <output dir>\n", fr->progname);
 	printf("Options:\n");
 	printf("  --help                   Display this information\n");
+	printf("  -v                       Verbose output, twice for details per glyph\n");
 	printf("  -o=<file>                Place the output atlas png into <file>\n");
 	printf("  -m=<file>                Place the output font metrics into <file>\n");
 	printf("  -W=<n>                   Set atlas width to <n>\n");
 	printf("  -H=<n>                   Set atlas height to <n>\n");
-	printf("  -s=<n>                   Render glyphs with height of <n> pixels\n");
+	printf("  -s=<n>[,<n>...]          Render glyphs with height of <n> pixels\n");
 	printf("  -p=<n>                   Pad glyph with <n> pixels\n");
 	printf("  -b=<n>                   Glyph border of <n> pixels\n");
 	printf("  --no-antialias           Render glyphs without antialiasing\n");
-	printf("  --metrics-format=[text|binary]\n"
-	       "                           Write metrics as text or binary\n");
+	printf("  --variants=<v>[,<v>...]  Render each glyph once per variant, "
+	       "of normal, mono or sdf,\n"
+	       "                           each to its own atlas and metrics\n");
+	printf("  --pipeline               Stream glyphs through concurrent rasterize, "
+	       "pack and encode stages\n");
+	printf("  --embedded-bitmaps       Use embedded bitmaps when a strike matches "
+	       "the render size\n");
+	printf("  --append                 Add missing runes to the existing atlas and "
+	       "binary metrics\n"
+	       "                           without moving the glyphs already there\n");
+	printf("  --dry-run                Report the atlas size, pages and fill ratio "
+	       "needed by\n"
+	       "                           the glyph boxes without rendering nor "
+	       "writing files\n");
+	printf("  --if-changed             Leave output files identical to the existing "
+	       "ones untouched,\n"
+	       "                           replace the others atomically\n");
+	printf("  --outline=<r>            Bake an outline of radius <r> pixels in "
+	       "an atlas channel\n");
+	printf("  --shadow=<s>[,<x>,<y>]   Bake a shadow blurred by a deviation of <s> "
+	       "pixels,\n"
+	       "                           moved by <x>,<y> pixels, in an atlas "
+	       "channel\n");
+	printf("  --subpixel=<n>           Render <n> horizontal subpixel phases of "
+	       "each glyph,\n"
+	       "                           up to %d\n", MAX_PHASES);
+	printf("  --tile-size=<n>          Store atlases as <n>x<n> tiles allocated "
+	       "on first use\n");
+	printf("  --curves=<file>          Export glyph outlines as quadratic curves "
+	       "to <file> instead\n"
+	       "                           of rasterizing, checked against FreeType "
+	       "with -v\n");
+	printf("  --metrics-format=<f>[,<f>...]\n"
+	       "                           Write metrics as text, binary, csv or json; "
+	       "several\n"
+	       "                           formats each go to the metrics file with "
+	       "their extension\n");
 	printf("  --rune=,<range>          Comma separated unicode point or point ranges\n");
+	printf("  --jobs=<n>               Sweep fonts with <n> workers, one per "
+	       "processor by default\n");
+	printf("  --strings=<file>         Render each UTF-8 line of <file> as a single "
+	       "sprite\n");
 	printf("Notes:\n");
+	printf("  Runes missing from a font are looked up in the following fonts, "
+	       "in order; <face> selects a face inside a font collection\n");
+	printf("  A sweep rasterizes each face of every font below <font dir> "
+	       "with the same options,\n"
+	       "  to <output dir>/<font path>[-<face>].png and its metrics\n");
+	printf("  String sprites are looked up by their line index "
+	       "with the 0x80000000 bit set\n");
 	printf("  Ranges are in the form <c>, <l>:<u> or <l>+<n>; "
 	       "of single code point <c>, lower bound <l>, upper bound <u> and extend <n>\n");
 	exit(0);
@@ -48,7 +97,20 @@ static struct option long_options[] = {
 	{ "help", no_argument, 0, 'h' },
 	{ "no-antialias", no_argument, 0, 'a' },
 	{ "metrics-format", required_argument, 0, 'f' },
+	{ "variants", required_argument, 0, 'V' },
+	{ "pipeline", no_argument, 0, 'P' },
+	{ "embedded-bitmaps", no_argument, 0, 'E' },
+	{ "append", no_argument, 0, 'A' },
+	{ "tile-size", required_argument, 0, 'T' },
+	{ "curves", required_argument, 0, 'C' },
+	{ "strings", required_argument, 0, 'S' },
+	{ "dry-run", no_argument, 0, 'D' },
+	{ "if-changed", no_argument, 0, 'I' },
+	{ "subpixel", required_argument, 0, 'X' },
+	{ "outline", required_argument, 0, 'O' },
+	{ "shadow", required_argument, 0, 'Y' },
 	{ "rune", required_argument, 0, 'r' },
+	{ "jobs", required_argument, 0, 'j' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -91,23 +153,193 @@ static int extract_range(int *lo, int *hi, const char *s)
 	return (*lo > *hi) || (*lo < 0);
 }
 
+static const char *metrics_format_names[MF_COUNT] = {
+	[MF_TEXT] = "text",
+	[MF_BINARY] = "binary",
+	[MF_CSV] = "csv",
+	[MF_JSON] = "json",
+};
+
+/*
+ * Parses a comma separated list of metrics formats into a mask, the
+ * first one being stored in fr->format.
+ * Returns 0 (no error) or 1 if a format is not a valid one.
+ */
+static int get_metrics_formats(const char *s, struct fr *fr)
+{
+	const char *delim = ",";
+	char *copy = mystrdup(s);
+	const char *tok;
+	int err = 0;
+	int f;
+
+	fr->formats = 0;
+	for (tok = strtok(copy, delim); tok; tok = strtok(NULL, delim)) {
+		for (f = 0; f < MF_COUNT; f++)
+			if (!strcmp(tok, metrics_format_names[f]))
+				break;
+		if (f == MF_COUNT) {
+			err = 1;
+			break;
+		}
+		if (!fr->formats)
+			fr->format = f;
+		fr->formats |= 1 << f;
+	}
+
+	free(copy);
+	return err || !fr->formats;
+}
+
+/*
+ * Appends a face to the fallback chain. The face index of a collection
+ * is given as a ':<index>' suffix, it is only taken into account when
+ * made of digits so that paths containing colons still work.
+ */
+static void add_face(const char *s, struct fr *fr)
+{
+	face_t **tail;
+	face_t *face;
+	const char *colon;
+	char *endptr;
+
+	face = malloc(sizeof(face_t));
+	if (!face)
+		die("out of memory");
+
+	face->filename = mystrdup(s);
+	face->index = 0;
+	face->next = NULL;
+
+	colon = strrchr(s, ':');
+	if (colon && colon[1] != '\0') {
+		long index = strtol(colon + 1, &endptr, 10);
+		if (*endptr == '\0' && index >= 0) {
+			face->filename[colon - s] = '\0';
+			face->index = index;
+		}
+	}
+
+	for (tail = &fr->faces; *tail; tail = &(*tail)->next)
+		;
+	*tail = face;
+	fr->num_faces++;
+}
+
+/*
+ * Parses a comma separated list of render sizes.
+ * Returns 0 (no error) or 1 if one of the sizes is invalid.
+ */
+static int get_sizes(const char *s, struct fr *fr)
+{
+	const char *delim = ",";
+	char *copy = mystrdup(s);
+	const char *tok;
+	char *endptr;
+	int err = 0;
+
+	free(fr->pixel_heights);
+	fr->pixel_heights = NULL;
+	fr->num_sizes = 0;
+
+	for (tok = strtok(copy, delim); tok; tok = strtok(NULL, delim)) {
+		int size = strtol(tok, &endptr, 10);
+		if (*endptr != '\0' || size <= 0) {
+			err = 1;
+			break;
+		}
+
+		fr->pixel_heights = realloc(fr->pixel_heights,
+					    sizeof(int) * (fr->num_sizes + 1));
+		if (!fr->pixel_heights)
+			die("out of memory");
+		fr->pixel_heights[fr->num_sizes++] = size;
+	}
+
+	free(copy);
+	return err || !fr->num_sizes;
+}
+
+static const char *variant_names[RV_COUNT] = {
+	[RV_NORMAL] = "normal",
+	[RV_MONO] = "mono",
+	[RV_SDF] = "sdf",
+};
+
+const char *variant_name(int variant)
+{
+	return variant_names[variant];
+}
+
+/*
+ * Parses a comma separated list of rendering variants.
+ * Returns 0 (no error) or 1 if a variant is unknown or repeated.
+ */
+static int get_variants(const char *s, struct fr *fr)
+{
+	const char *delim = ",";
+	char *copy = mystrdup(s);
+	const char *tok;
+	int err = 0;
+	int i, v;
+
+	fr->num_variants = 0;
+	for (tok = strtok(copy, delim); tok; tok = strtok(NULL, delim)) {
+		for (v = 0; v < RV_COUNT; v++)
+			if (!strcmp(tok, variant_names[v]))
+				break;
+		for (i = 0; i < fr->num_variants; i++)
+			if (fr->variants[i] == v)
+				break;
+		if (v == RV_COUNT || i < fr->num_variants) {
+			err = 1;
+			break;
+		}
+		fr->variants[fr->num_variants++] = v;
+	}
+
+	free(copy);
+	return err || !fr->num_variants;
+}
+
 /*
- * Returns the requested metrics format.
- * Returns -1 if the format is not a valid one.
+ * Parses the shadow deviation, optionally followed by its offset as
+ * <sigma>,<dx>,<dy>.
+ * Returns 0 (no error) or 1 if the shadow is invalid.
  */
-static int get_metrics_format(const char *s)
+static int get_shadow(const char *s, struct fr *fr)
 {
-	if (!strcmp(s, "text"))
-		return MF_TEXT;
-	else if (!strcmp(s, "binary"))
-		return MF_BINARY;
-	return -1;
+	char *endptr;
+
+	fr->shadow = strtof(s, &endptr);
+	if (endptr == s || fr->shadow <= 0.0f)
+		return 1;
+	fr->shadow_offset[0] = 0;
+	fr->shadow_offset[1] = 0;
+	if (!*endptr)
+		return 0;
+
+	s = endptr;
+	if (*s++ != ',')
+		return 1;
+	fr->shadow_offset[0] = strtol(s, &endptr, 10);
+	if (endptr == s || *endptr != ',')
+		return 1;
+	s = endptr + 1;
+	fr->shadow_offset[1] = strtol(s, &endptr, 10);
+
+	return endptr == s || *endptr;
 }
 
 static int get_ranges(const char *s, struct fr *fr)
 {
 	int lo, hi, err = 0;
 	const char *delim = ",";
+	range_t **tail;
+
+	/* Ranges are kept in command line order */
+	for (tail = &fr->ranges; *tail; tail = &(*tail)->next)
+		;
 
 	/* strtok modifies the string so duplicate it first */
 	char *copy = mystrdup(s);
@@ -118,8 +350,9 @@ static int get_ranges(const char *s, struct fr *fr)
 			range_t *range = malloc(sizeof(range_t));
 			range->lo = lo;
 			range->hi = hi;
-			range->next = fr->ranges;
-			fr->ranges = range;
+			range->next = NULL;
+			*tail = range;
+			tail = &range->next;
 		} else {
 			warning("invalid range %s\n", tok);
 			err = 1;
@@ -132,9 +365,39 @@ static int get_ranges(const char *s, struct fr *fr)
 	return err;
 }
 
+/*
+ * Reads the strings to render as sprites, one per line. A string index
+ * is its line number, empty lines included, so that ids are stable.
+ */
+static void read_strings(const char *path, struct fr *fr)
+{
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		error("opening %s", path);
+
+	while ((len = getline(&line, &capacity, fp)) != -1) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+
+		fr->strings = realloc(fr->strings,
+				      sizeof(char *) * (fr->num_strings + 1));
+		if (!fr->strings)
+			die("out of memory");
+		fr->strings[fr->num_strings++] = mystrdup(line);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
 int fr_getopt(struct fr *fr)
 {
-	return getopt_long(fr->argc, fr->argv, "hvao:m:W:H:s:p:b:f:", long_options, NULL);
+	return getopt_long(fr->argc, fr->argv, "hvao:m:W:H:s:p:b:f:V:", long_options, NULL);
 }
 
 void parse_options(struct fr *fr)
@@ -148,7 +411,7 @@ void parse_options(struct fr *fr)
 			usage(fr);
 			break;
 		case 'v':
-			fr->option_verbose = 1;
+			fr->option_verbose++;
 			break;
 		case 'a':
 			fr->no_antialias = 1;
@@ -174,8 +437,7 @@ void parse_options(struct fr *fr)
 			}
 			break;
 		case 's':
-			fr->pixel_height = atoi(optarg);
-			if (fr->pixel_height <= 0) {
+			if (get_sizes(optarg, fr)) {
 				error("invalid size: %s", optarg);
 				invalid_arg = 1;
 			}
@@ -197,9 +459,69 @@ void parse_options(struct fr *fr)
 		case 'r':
 			get_ranges(optarg, fr);
 			break;
+		case 'T':
+			fr->tile_size = atoi(optarg);
+			if (fr->tile_size <= 0) {
+				error("invalid tile size: %s", optarg);
+				invalid_arg = 1;
+			}
+			break;
+		case 'I':
+			fr->if_changed = 1;
+			break;
+		case 'O':
+			fr->outline = atoi(optarg);
+			if (fr->outline <= 0) {
+				error("invalid outline radius: %s", optarg);
+				invalid_arg = 1;
+			}
+			break;
+		case 'Y':
+			if (get_shadow(optarg, fr)) {
+				error("invalid shadow: %s", optarg);
+				invalid_arg = 1;
+			}
+			break;
+		case 'X':
+			fr->phases = atoi(optarg);
+			if (fr->phases < 1 || fr->phases > MAX_PHASES) {
+				error("invalid subpixel phases: %s", optarg);
+				invalid_arg = 1;
+			}
+			break;
+		case 'j':
+			fr->jobs = atoi(optarg);
+			if (fr->jobs < 1) {
+				error("invalid number of jobs: %s", optarg);
+				invalid_arg = 1;
+			}
+			break;
+		case 'D':
+			fr->dry_run = 1;
+			break;
+		case 'S':
+			read_strings(optarg, fr);
+			break;
+		case 'C':
+			fr->curves_filename = mystrdup(optarg);
+			break;
+		case 'A':
+			fr->append = 1;
+			break;
+		case 'E':
+			fr->embedded_bitmaps = 1;
+			break;
+		case 'P':
+			fr->pipeline = 1;
+			break;
+		case 'V':
+			if (get_variants(optarg, fr)) {
+				error("invalid variants: %s", optarg);
+				invalid_arg = 1;
+			}
+			break;
 		case 'f':
-			fr->format = get_metrics_format(optarg);
-			if (fr->format == -1) {
+			if (get_metrics_formats(optarg, fr)) {
 				error("invalid metrics format: %s", optarg);
 				invalid_arg = 1;
 			}
@@ -214,53 +536,119 @@ void parse_options(struct fr *fr)
 			exit(1);
 	}
 
-	/* Handle non-option arguments (ie: font names) */
-	if (optind < fr->argc) {
-		/*
-		 * Take the first positional argument, pending ones
-		 * are just ignored.
-		 */
-		fr->font_filename = mystrdup(fr->argv[optind++]);
+	/*
+	 * Handle non-option arguments (ie: font names). The first one is
+	 * the primary font, pending ones form its fallback chain. A sweep
+	 * takes its font and output directories instead.
+	 */
+	if (fr->sweep) {
+		if (fr->argc - optind != 2) {
+			error("sweep needs a font directory and an output directory");
+			exit(1);
+		}
+		fr->sweep_dir = mystrdup(fr->argv[optind++]);
+		fr->sweep_output = mystrdup(fr->argv[optind++]);
+		if (fr->append || fr->dry_run || fr->curves_filename) {
+			error("--append, --dry-run and --curves don't apply to a sweep");
+			exit(1);
+		}
+		if (!fr->jobs)
+			fr->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (fr->jobs < 1)
+			fr->jobs = 1;
 	}
+	while (optind < fr->argc)
+		add_face(fr->argv[optind++], fr);
 
-	if (!fr->font_filename) {
+	if (!fr->faces && !fr->sweep) {
 		error("no input font file");
 		exit(1);
 	}
 
 	if (!fr->atlas_filename)
 		fr->atlas_filename = mystrdup("a.png");
+	if (!fr->formats)
+		fr->formats = 1 << fr->format;
 	if (!fr->metrics_filename) {
-		switch (fr->format) {
-		case MF_TEXT:
-			fr->metrics_filename = mystrdup("a.txt");
-			break;
-		case MF_BINARY:
-			fr->metrics_filename = mystrdup("a.bin");
-			break;
-		}
+		char name[16];
+		snprintf(name, sizeof(name), "a.%s", metrics_extension(fr->format));
+		fr->metrics_filename = mystrdup(name);
 	}
 
 	if (!fr->atlas_width)
 		fr->atlas_width = 256;
 	if (!fr->atlas_height)
 		fr->atlas_height = 256;
-	if (!fr->pixel_height)
-		fr->pixel_height = 16;
+	if (!fr->num_sizes)
+		get_sizes("16", fr);
+	if (!fr->phases)
+		fr->phases = 1;
 
 	if (!fr->ranges)
 		get_ranges("33:126", fr);
 
+	if (fr->append && (fr->formats != 1 << MF_BINARY || fr->num_variants)) {
+		error("--append needs binary metrics and a single variant");
+		exit(1);
+	}
+
+	/* Distance fields are not coverage, effects make no sense there. */
+	if (fr->outline || fr->shadow > 0.0f) {
+		int v;
+		for (v = 0; v < fr->num_variants; v++) {
+			if (fr->variants[v] == RV_SDF) {
+				error("--outline and --shadow don't apply to the sdf variant");
+				exit(1);
+			}
+		}
+	}
+
+	/* The face index is stored on a byte in binary metrics. */
+	if (fr->num_faces > 256) {
+		error("too many fonts: %d", fr->num_faces);
+		exit(1);
+	}
+
 	if (fr->option_verbose) {
-		printf("input font file: %s\n", fr->font_filename);
-		printf("output atlas file: %s\n", fr->atlas_filename);
-		printf("output metrics file: %s\n", fr->metrics_filename);
-		printf("antialised rendering: %s\n", fr->no_antialias ? "no" : "yes");
-		printf("rendering size: %d\n", fr->pixel_height);
+		const face_t *face = fr->faces;
+		for (; face; face = face->next)
+			printf("input font file: %s (face %d)\n",
+			       face->filename, face->index);
+		if (fr->sweep) {
+			printf("sweeping fonts of %s to %s with %d workers\n",
+			       fr->sweep_dir, fr->sweep_output, fr->jobs);
+		} else {
+			printf("output atlas file: %s\n", fr->atlas_filename);
+			printf("output metrics file: %s\n", fr->metrics_filename);
+		}
+		if (fr->curves_filename)
+			printf("output curves file: %s\n", fr->curves_filename);
+		if (fr->num_variants) {
+			int v;
+			for (v = 0; v < fr->num_variants; v++)
+				printf("rendering variant: %s\n",
+				       variant_name(fr->variants[v]));
+		} else {
+			printf("antialised rendering: %s\n", fr->no_antialias ? "no" : "yes");
+		}
+		int i;
+		for (i = 0; i < fr->num_sizes; i++)
+			printf("rendering size: %d\n", fr->pixel_heights[i]);
 		printf("padding: %d\n", fr->padding);
+		if (fr->outline)
+			printf("outline radius: %d\n", fr->outline);
+		if (fr->shadow > 0.0f)
+			printf("shadow: deviation %g, offset %d,%d\n", fr->shadow,
+			       fr->shadow_offset[0], fr->shadow_offset[1]);
+		if (fr->phases > 1)
+			printf("subpixel phases: %d\n", fr->phases);
+		if (fr->tile_size)
+			printf("atlas tiles: %dx%d\n", fr->tile_size, fr->tile_size);
 		printf("border: %d\n", fr->border);
 		const range_t *range = fr->ranges;
 		for (; range; range = range->next)
 			printf("rune range: %d to %d\n", range->lo, range->hi);
+		for (i = 0; i < fr->num_strings; i++)
+			printf("string %d: %s\n", i, fr->strings[i]);
 	}
 }
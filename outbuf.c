@@ -0,0 +1,217 @@
+#include "fr.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Output buffers gather formatted metrics in memory and write them out
+ * in large chunks. Numbers are formatted by hand rather than through
+ * stdio, floats in their shortest form that reads back unchanged.
+ */
+
+#define OUTBUF_SIZE (1 << 20)
+
+int outbuf_open(struct outbuf *out, const char *path, int flags)
+{
+	if (output_open(&out->file, path, flags))
+		return 1;
+
+	out->data = malloc(OUTBUF_SIZE);
+	if (!out->data) {
+		out->file.failed = 1;
+		output_close(&out->file);
+		return 1;
+	}
+	out->len = 0;
+	out->capacity = OUTBUF_SIZE;
+	out->failed = 0;
+
+	return 0;
+}
+
+static void outbuf_flush(struct outbuf *out)
+{
+	if (out->len)
+		output_write(&out->file, out->data, out->len);
+	out->len = 0;
+}
+
+/* Returns 0 or 1 if anything failed to be written */
+int outbuf_close(struct outbuf *out)
+{
+	outbuf_flush(out);
+	if (output_close(&out->file))
+		out->failed = 1;
+	free(out->data);
+	out->data = NULL;
+
+	return out->failed;
+}
+
+void outbuf_write(struct outbuf *out, const void *data, size_t size)
+{
+	if (out->len + size > out->capacity) {
+		outbuf_flush(out);
+		if (size > out->capacity) {
+			output_write(&out->file, data, size);
+			return;
+		}
+	}
+
+	memcpy(out->data + out->len, data, size);
+	out->len += size;
+}
+
+void outbuf_puts(struct outbuf *out, const char *s)
+{
+	outbuf_write(out, s, strlen(s));
+}
+
+void outbuf_putc(struct outbuf *out, char c)
+{
+	if (out->len == out->capacity)
+		outbuf_flush(out);
+	out->data[out->len++] = c;
+}
+
+void outbuf_uint(struct outbuf *out, unsigned long v)
+{
+	char digits[24];
+	int n = sizeof(digits);
+
+	do {
+		digits[--n] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	outbuf_write(out, digits + n, sizeof(digits) - n);
+}
+
+void outbuf_int(struct outbuf *out, long v)
+{
+	if (v < 0) {
+		outbuf_putc(out, '-');
+		outbuf_uint(out, -(unsigned long)v);
+	} else {
+		outbuf_uint(out, v);
+	}
+}
+
+static double scale10(double v, int exponent)
+{
+	if (exponent >= 0)
+		return v * pow(10.0, exponent);
+	return v / pow(10.0, -exponent);
+}
+
+/*
+ * Appends the shortest plain decimal which reads back as v. Candidates
+ * of increasing precision are rounded from v and checked against the
+ * interval of reals rounding to v, bounded by the midpoints to its
+ * neighbours, which are exact as doubles. Bounds belong to the
+ * interval when v has an even mantissa, as ties round to even.
+ */
+void outbuf_float(struct outbuf *out, float v)
+{
+	char digits[24];
+	double lo, hi, candidate;
+	long long n;
+	uint32_t bits;
+	int shift = 0, precision, len, i, even;
+
+	if (isnan(v)) {
+		outbuf_puts(out, "nan");
+		return;
+	}
+	if (signbit(v)) {
+		outbuf_putc(out, '-');
+		v = -v;
+	}
+	if (isinf(v)) {
+		outbuf_puts(out, "inf");
+		return;
+	}
+	if (v == 0.0f) {
+		outbuf_putc(out, '0');
+		return;
+	}
+
+	memcpy(&bits, &v, sizeof(bits));
+	even = !(bits & 1);
+	lo = ((double)v + nextafterf(v, 0.0f)) / 2.0;
+	hi = ((double)v + nextafterf(v, INFINITY)) / 2.0;
+
+	/* Nine significant digits always identify a float. */
+	for (precision = 1; precision <= 9; precision++) {
+		shift = precision - 1 - (int)floor(log10(v));
+		n = llround(scale10(v, shift));
+		candidate = scale10(n, -shift);
+		if ((candidate > lo && candidate < hi) ||
+		    (even && (candidate == lo || candidate == hi)))
+			break;
+	}
+
+	/* Trailing zeros of the integer part are only kept as such. */
+	while (shift > 0 && n % 10 == 0) {
+		n /= 10;
+		shift--;
+	}
+
+	len = 0;
+	do {
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	if (shift <= 0) {
+		for (i = len - 1; i >= 0; i--)
+			outbuf_putc(out, digits[i]);
+		for (i = 0; i < -shift; i++)
+			outbuf_putc(out, '0');
+	} else if (shift >= len) {
+		outbuf_puts(out, "0.");
+		for (i = 0; i < shift - len; i++)
+			outbuf_putc(out, '0');
+		for (i = len - 1; i >= 0; i--)
+			outbuf_putc(out, digits[i]);
+	} else {
+		for (i = len - 1; i >= 0; i--) {
+			outbuf_putc(out, digits[i]);
+			if (i == shift)
+				outbuf_putc(out, '.');
+		}
+	}
+}
+
+/*
+ * Appends the UTF-8 encoding of a rune. Surrogates and runes beyond the
+ * unicode range are encoded as U+FFFD.
+ */
+void outbuf_utf8(struct outbuf *out, uint32_t rune)
+{
+	char s[4];
+
+	if ((rune >= 0xD800 && rune <= 0xDFFF) || rune > 0x10FFFF)
+		rune = 0xFFFD;
+
+	if (rune < 0x80) {
+		s[0] = rune;
+		outbuf_write(out, s, 1);
+	} else if (rune < 0x800) {
+		s[0] = 0xC0 | (rune >> 6);
+		s[1] = 0x80 | (rune & 0x3F);
+		outbuf_write(out, s, 2);
+	} else if (rune < 0x10000) {
+		s[0] = 0xE0 | (rune >> 12);
+		s[1] = 0x80 | ((rune >> 6) & 0x3F);
+		s[2] = 0x80 | (rune & 0x3F);
+		outbuf_write(out, s, 3);
+	} else {
+		s[0] = 0xF0 | (rune >> 18);
+		s[1] = 0x80 | ((rune >> 12) & 0x3F);
+		s[2] = 0x80 | ((rune >> 6) & 0x3F);
+		s[3] = 0x80 | (rune & 0x3F);
+		outbuf_write(out, s, 4);
+	}
+}
@@ -0,0 +1,227 @@
+#include "fr.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Output files are written in place, unless OUTPUT_IF_CHANGED is set.
+ * They are then written to a temporary file next to their path while
+ * their FNV-1a hash is computed on the fly. Once complete, a file
+ * identical to the existing one is dropped, leaving the existing one
+ * and its modification time untouched, otherwise it atomically replaces
+ * it. The hash, size and modification time of the file are kept in a
+ * "<path>.fnv" sidecar, which spares reading the existing file on the
+ * next run.
+ */
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* Returns NULL when out of memory */
+static char *sidecar_filename(const char *path)
+{
+	char *s = malloc(strlen(path) + 5);
+
+	if (s)
+		sprintf(s, "%s.fnv", path);
+
+	return s;
+}
+
+/*
+ * Gets the hash and size of the existing file at path, from its sidecar
+ * when it recorded the same size and modification time, to the
+ * nanosecond, or by reading the file. valid_sidecar tells which one was
+ * used. A file rewritten to the same size by a tool that then restores
+ * its modification time still passes for the one the sidecar describes.
+ * Returns 0 or 1 if there is no readable file at path.
+ */
+static int existing_hash(const char *path, uint64_t *hash, uint64_t *size,
+			 int *valid_sidecar)
+{
+	char *sidecar = sidecar_filename(path);
+	struct stat st;
+	unsigned long long h, sz;
+	long long sec;
+	long nsec;
+	char chunk[65536];
+	size_t n;
+	FILE *fp;
+
+	*valid_sidecar = 0;
+	if (stat(path, &st)) {
+		free(sidecar);
+		return 1;
+	}
+
+	fp = sidecar ? fopen(sidecar, "r") : NULL;
+	if (fp) {
+		if (fscanf(fp, "fnv1a64 %llx %llu %lld.%ld", &h, &sz, &sec,
+			   &nsec) == 4 &&
+		    sz == (unsigned long long)st.st_size &&
+		    sec == (long long)st.st_mtim.tv_sec &&
+		    nsec == (long)st.st_mtim.tv_nsec) {
+			*hash = h;
+			*size = sz;
+			*valid_sidecar = 1;
+		}
+		fclose(fp);
+	}
+	free(sidecar);
+	if (*valid_sidecar)
+		return 0;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 1;
+	*hash = FNV_OFFSET;
+	*size = 0;
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+		*hash = fnv1a(*hash, chunk, n);
+		*size += n;
+	}
+	n = ferror(fp);
+	fclose(fp);
+
+	return n != 0;
+}
+
+/* Records the hash of the file at path along with its modification time */
+static void write_sidecar(const char *path, uint64_t hash, uint64_t size)
+{
+	char *sidecar = sidecar_filename(path);
+	struct stat st;
+	FILE *fp;
+
+	if (!sidecar)
+		return;
+	if (stat(path, &st)) {
+		free(sidecar);
+		return;
+	}
+	fp = fopen(sidecar, "w");
+	if (fp) {
+		fprintf(fp, "fnv1a64 %016llx %llu %lld.%09ld\n",
+			(unsigned long long)hash, (unsigned long long)size,
+			(long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+		if (fclose(fp))
+			unlink(sidecar);
+	}
+	free(sidecar);
+}
+
+int output_open(struct output *o, const char *path, int flags)
+{
+	int fd;
+
+	memset(o, 0, sizeof(*o));
+	o->flags = flags;
+	o->hash = FNV_OFFSET;
+	o->path = strdup(path);
+	if (!o->path)
+		return 1;
+
+	if (!(flags & OUTPUT_IF_CHANGED)) {
+		o->fp = fopen(path, "wb");
+		goto done;
+	}
+
+	/* Unique among processes and among the outputs of this one */
+	o->tmp_path = malloc(strlen(path) + 48);
+	if (!o->tmp_path)
+		goto done;
+	sprintf(o->tmp_path, "%s.%ld-%lx.tmp", path, (long)getpid(),
+		(unsigned long)(uintptr_t)o);
+
+	fd = open(o->tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd >= 0) {
+		o->fp = fdopen(fd, "wb");
+		if (!o->fp) {
+			close(fd);
+			unlink(o->tmp_path);
+		}
+	}
+
+done:
+	if (!o->fp) {
+		free(o->path);
+		free(o->tmp_path);
+		return 1;
+	}
+	return 0;
+}
+
+void output_write(struct output *o, const void *data, size_t size)
+{
+	if (o->flags & OUTPUT_IF_CHANGED)
+		o->hash = fnv1a(o->hash, data, size);
+	o->size += size;
+
+	if (fwrite(data, 1, size, o->fp) != size)
+		o->failed = 1;
+}
+
+/*
+ * Completes the output, a failed one being discarded when it went to a
+ * temporary file.
+ * Returns 0 (no error) or 1 if the file could not be written.
+ */
+int output_close(struct output *o)
+{
+	uint64_t hash, size;
+	struct stat st;
+	int err = o->failed;
+	int valid_sidecar;
+
+	/* The replacement keeps the mode of the existing file. */
+	if (o->tmp_path && !stat(o->path, &st) &&
+	    fchmod(fileno(o->fp), st.st_mode & 07777))
+		err = 1;
+
+	if (fclose(o->fp))
+		err = 1;
+	o->fp = NULL;
+
+	if (!o->tmp_path)
+		goto done;
+
+	if (err) {
+		unlink(o->tmp_path);
+	} else if (!existing_hash(o->path, &hash, &size, &valid_sidecar) &&
+		   hash == o->hash && size == o->size) {
+		unlink(o->tmp_path);
+		o->unchanged = 1;
+		if (!valid_sidecar)
+			write_sidecar(o->path, o->hash, o->size);
+		if (o->flags & OUTPUT_VERBOSE)
+			printf("%s is unchanged\n", o->path);
+	} else if (rename(o->tmp_path, o->path)) {
+		unlink(o->tmp_path);
+		err = 1;
+	} else {
+		write_sidecar(o->path, o->hash, o->size);
+	}
+
+done:
+	free(o->path);
+	free(o->tmp_path);
+	o->path = NULL;
+	o->tmp_path = NULL;
+
+	return err;
+}
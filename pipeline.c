@@ -0,0 +1,407 @@
+#include "fr.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Pipelined rasterization: the calling thread rasterizes glyphs in the
+ * very order of the batch mode and hands them to one packing thread
+ * per variant through a bounded queue. The packer places and blits each
+ * glyph as soon as it arrives, and whenever it starts a new line the
+ * rows above are final and sent as a band to an encoding thread which
+ * writes them to the png file. Once all glyphs are packed, metrics are
+ * written while the last bands are still being encoded. When anything
+ * fails, the lanes still drain their queues but drop their outputs.
+ */
+
+#define GLYPH_QUEUE_SIZE 256
+#define BAND_QUEUE_SIZE 16
+
+/* Bounded FIFO of pointers */
+struct queue {
+	void **items;
+	int capacity;
+	int head;
+	int count;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/* Rows y0 to y1 (excluded) of the atlas are final */
+struct band {
+	int y0;
+	int y1;
+};
+
+/* Packing and encoding stages of one rendering variant */
+struct lane {
+	const struct fr *fr;
+	const struct raster_context *ctx;
+	int v;
+	char *atlas_filename;
+	char *metrics_filename;
+	struct bitmap *atlas;
+	struct packer packer;
+	struct queue glyphs;
+	struct queue bands;
+	pthread_t pack_thread;
+	pthread_t encode_thread;
+	int failed; /* the atlas could not be written */
+	int metrics_failed;
+	int aborted; /* set before the glyph queue closes */
+	int dropped; /* set before the band queue closes */
+
+	/* Busy time of each stage, in seconds */
+	double pack_time;
+	double metrics_time;
+	double encode_time;
+	double first_band; /* since the start of the pipeline */
+};
+
+struct pipeline {
+	struct lane *lanes;
+	double start;
+	double wait_time; /* rasterizer blocked on full queues */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Returns 0 or 1 when out of memory */
+static int queue_init(struct queue *q, int capacity)
+{
+	q->items = malloc(sizeof(void *) * capacity);
+	if (!q->items)
+		return 1;
+	q->capacity = capacity;
+	q->head = 0;
+	q->count = 0;
+	q->closed = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+
+	return 0;
+}
+
+static void queue_destroy(struct queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	free(q->items);
+}
+
+/* Blocks while the queue is full */
+static void queue_push(struct queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->capacity)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->items[(q->head + q->count++) % q->capacity] = item;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Blocks while the queue is empty, returns NULL once closed and drained */
+static void *queue_pop(struct queue *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->count && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->count) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return item;
+}
+
+static void queue_close(struct queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Once a band can't be allocated, the atlas is dropped. */
+static void push_band(struct lane *lane, int y0, int y1)
+{
+	struct band *band;
+
+	if (y0 >= y1 || lane->dropped)
+		return;
+
+	band = malloc(sizeof(*band));
+	if (!band) {
+		lane->dropped = 1;
+		return;
+	}
+	band->y0 = y0;
+	band->y1 = y1;
+	queue_push(&lane->bands, band);
+}
+
+static void *pack_stage(void *data)
+{
+	struct lane *lane = data;
+	struct raster_glyph *glyph;
+	int final_rows = 0;
+	int rows;
+	double t;
+
+	while ((glyph = queue_pop(&lane->glyphs))) {
+		t = now();
+		if (!packer_place(&lane->packer, glyph))
+			blit_glyph(lane->atlas, glyph);
+		lane->pack_time += now() - t;
+
+		/*
+		 * Rows above the current line won't change anymore. With
+		 * tiles, only whole rows of tiles are handed over so that
+		 * the encoder never reads a tile the packer may allocate.
+		 */
+		rows = lane->packer.pen_y;
+		if (lane->atlas->tile_size)
+			rows -= rows % lane->atlas->tile_size;
+		if (rows > final_rows) {
+			push_band(lane, final_rows, rows);
+			final_rows = rows;
+		}
+	}
+	if (lane->aborted || lane->atlas->failed)
+		lane->dropped = 1;
+	push_band(lane, final_rows, lane->atlas->height);
+	queue_close(&lane->bands);
+	if (lane->dropped)
+		return NULL;
+
+	/* Texture coordinates are all known, overlap with the encoder. */
+	t = now();
+	lane->metrics_failed =
+		write_metrics(&lane->ctx->groups[lane->v * lane->ctx->num_sizes],
+			      lane->ctx->num_sizes, lane->metrics_filename,
+			      lane->fr->formats, output_flags(lane->fr));
+	lane->metrics_time = now() - t;
+
+	return NULL;
+}
+
+static void *encode_stage(void *data)
+{
+	struct lane *lane = data;
+	struct png_stream ps;
+	struct band *band;
+	double start = now();
+	double t;
+
+	lane->failed = png_stream_open(&ps, lane->atlas_filename,
+				       lane->atlas->width, lane->atlas->height,
+				       lane->atlas->channels,
+				       output_flags(lane->fr));
+	lane->encode_time = now() - start;
+
+	while ((band = queue_pop(&lane->bands))) {
+		t = now();
+		if (!lane->first_band)
+			lane->first_band = t;
+		if (!lane->failed)
+			png_stream_rows(&ps, lane->atlas, band->y0, band->y1);
+		free(band);
+		lane->encode_time += now() - t;
+	}
+
+	t = now();
+	if (!lane->failed && lane->dropped)
+		ps.failed = 1;
+	if (!lane->failed)
+		lane->failed = png_stream_close(&ps);
+	lane->encode_time += now() - t;
+
+	return NULL;
+}
+
+static void emit_glyph(struct raster_glyph *glyph, int v, void *data)
+{
+	struct pipeline *pipeline = data;
+	double t = now();
+
+	queue_push(&pipeline->lanes[v].glyphs, glyph);
+	pipeline->wait_time += now() - t;
+}
+
+/*
+ * Sets up a lane and starts its threads.
+ * Returns 0 or 1 if the lane could not be started, which fails the
+ * context.
+ */
+static int start_lane(struct lane *lane, struct raster_context *ctx,
+		      const struct fr *fr, int v)
+{
+	lane->fr = fr;
+	lane->ctx = ctx;
+	lane->v = v;
+	if (fr->num_variants) {
+		lane->atlas_filename = variant_filename(fr->atlas_filename,
+							ctx->variants[v]);
+		lane->metrics_filename = variant_filename(fr->metrics_filename,
+							  ctx->variants[v]);
+		if (!lane->atlas_filename || !lane->metrics_filename)
+			goto failure;
+	} else {
+		lane->atlas_filename = fr->atlas_filename;
+		lane->metrics_filename = fr->metrics_filename;
+	}
+	lane->atlas = create_tiled_bitmap(fr->atlas_width, fr->atlas_height,
+					  fr->tile_size, ctx->effects.channels);
+	if (!lane->atlas)
+		goto failure;
+	packer_init(&lane->packer, fr->atlas_width, fr->atlas_height,
+		    fr->padding);
+	if (queue_init(&lane->glyphs, GLYPH_QUEUE_SIZE))
+		goto failure;
+	if (queue_init(&lane->bands, BAND_QUEUE_SIZE)) {
+		queue_destroy(&lane->glyphs);
+		goto failure;
+	}
+
+	if (pthread_create(&lane->encode_thread, NULL, encode_stage, lane)) {
+		raster_fail(ctx, "unable to start pipeline threads");
+		goto threads_failure;
+	}
+	if (pthread_create(&lane->pack_thread, NULL, pack_stage, lane)) {
+		raster_fail(ctx, "unable to start pipeline threads");
+		lane->dropped = 1;
+		queue_close(&lane->bands);
+		pthread_join(lane->encode_thread, NULL);
+		goto threads_failure;
+	}
+
+	return 0;
+
+threads_failure:
+	queue_destroy(&lane->glyphs);
+	queue_destroy(&lane->bands);
+failure:
+	raster_fail(ctx, "out of memory");
+	if (lane->atlas)
+		destroy_bitmap(lane->atlas);
+	if (fr->num_variants) {
+		free(lane->atlas_filename);
+		free(lane->metrics_filename);
+	}
+	return 1;
+}
+
+void rasterize_font_pipelined(struct raster_context *ctx, const struct fr *fr)
+{
+	struct pipeline pipeline;
+	double raster_time = 0.0;
+	double busy_time = 0.0;
+	double first_band = 0.0;
+	double wall_time;
+	int num_lanes, k, v;
+
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.lanes = calloc(ctx->num_variants, sizeof(struct lane));
+	if (!pipeline.lanes) {
+		raster_fail(ctx, "out of memory");
+		return;
+	}
+	pipeline.start = now();
+
+	for (num_lanes = 0; num_lanes < ctx->num_variants; num_lanes++)
+		if (start_lane(&pipeline.lanes[num_lanes], ctx, fr, num_lanes))
+			break;
+
+	ctx->emit = emit_glyph;
+	ctx->emit_data = &pipeline;
+	for (k = 0; k < fr->num_sizes && !ctx->failure[0]; k++)
+		rasterize_size(ctx, k, fr);
+	ctx->emit = NULL;
+	raster_time = now() - pipeline.start - pipeline.wait_time;
+	busy_time += raster_time;
+
+	for (v = 0; v < num_lanes; v++) {
+		pipeline.lanes[v].aborted = ctx->failure[0] != 0;
+		queue_close(&pipeline.lanes[v].glyphs);
+	}
+
+	for (v = 0; v < num_lanes; v++) {
+		struct lane *lane = &pipeline.lanes[v];
+
+		pthread_join(lane->pack_thread, NULL);
+		pthread_join(lane->encode_thread, NULL);
+		if (lane->aborted)
+			continue;
+		if (lane->dropped)
+			raster_fail(ctx, "out of memory");
+		if (lane->failed)
+			raster_fail(ctx, "writing %s", lane->atlas_filename);
+		if (lane->metrics_failed)
+			raster_fail(ctx, "writing %s", lane->metrics_filename);
+
+		busy_time += lane->pack_time + lane->metrics_time +
+			     lane->encode_time;
+		if (lane->first_band && (!first_band || lane->first_band < first_band))
+			first_band = lane->first_band;
+
+		if (fr->option_verbose)
+			printf("%d glyphs rasterized to atlas %s\n",
+			       ctx->num_glyphs[v], lane->atlas_filename);
+		if (fr->option_verbose && ctx->phases > 1)
+			printf("%d subpixel phases share the pixels of another\n",
+			       ctx->num_shared[v]);
+	}
+	wall_time = now() - pipeline.start;
+
+	if (fr->option_verbose && !ctx->failure[0]) {
+		for (v = 0; v < num_lanes; v++) {
+			struct lane *lane = &pipeline.lanes[v];
+			printf("pipeline %s: pack %.1f ms, encode %.1f ms, metrics %.1f ms\n",
+			       variant_name(ctx->variants[v]),
+			       lane->pack_time * 1e3, lane->encode_time * 1e3,
+			       lane->metrics_time * 1e3);
+		}
+		if (first_band)
+			printf("pipeline: rasterize %.1f ms, first rows encoded at %.1f ms\n",
+			       raster_time * 1e3, (first_band - pipeline.start) * 1e3);
+		else
+			printf("pipeline: rasterize %.1f ms, no rows encoded\n",
+			       raster_time * 1e3);
+		printf("pipeline: %.1f ms of stage work in %.1f ms (%.2fx overlap)\n",
+		       busy_time * 1e3, wall_time * 1e3, busy_time / wall_time);
+	}
+
+	for (v = 0; v < num_lanes; v++) {
+		struct lane *lane = &pipeline.lanes[v];
+
+		queue_destroy(&lane->glyphs);
+		queue_destroy(&lane->bands);
+		destroy_bitmap(lane->atlas);
+		if (fr->num_variants) {
+			free(lane->atlas_filename);
+			free(lane->metrics_filename);
+		}
+	}
+	free(pipeline.lanes);
+
+	if (fr->option_verbose && !ctx->failure[0])
+		printf("Done.\n");
+}
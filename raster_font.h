@@ -3,19 +3,96 @@
 
 #include <stdint.h>
 
+/*
+ * Binary metrics hold one header per render size, each followed by its
+ * rune lookup table and glyph definitions. Offsets are relative to the
+ * beginning of the file, next_offset is 0 for the last size.
+ */
 struct metrics_hdr {
 	uint32_t glyph_count;
 	float space_advance;
 	uint32_t lut_offset;
 	uint32_t glyph_offset;
+	uint32_t render_size;
+	float height;
+	uint32_t next_offset;
 };
 
+/*
+ * String sprites are looked up like runes, with this flag set on the
+ * index of their string. It lies beyond the unicode range.
+ */
+#define STRING_RUNE_FLAG (0x80000000u)
+
 struct glyph_def {
 	float bearing[2];
 	float advance[2];
 	float size[2];
 	uint16_t st0[2];
 	uint16_t st1[2];
+	uint8_t face; /* index of the source face in the fallback chain */
+	uint8_t page; /* atlas page holding the glyph */
+	uint8_t phase; /* subpixel phase, see below */
+	uint8_t reserved;
+};
+
+/*
+ * With subpixel phases, every rune has phase_count consecutive glyphs,
+ * phase p being rendered with the outline moved right by p / phase_count
+ * pixel. Bearings include that move, so that the glyph is drawn from the
+ * whole pixel left of the pen with the phase nearest to its fraction.
+ * phase_count is one more than the largest phase of a size.
+ */
+
+/*
+ * Curve files hold glyph outlines as quadratic Bézier curves, for
+ * rendering straight from the curves. The header is followed by the
+ * rune lookup table, the glyph definitions, the curves, the bands and
+ * the band curve indices. Offsets are relative to the beginning of the
+ * file and lengths are in em.
+ */
+struct curves_hdr {
+	uint32_t glyph_count;
+	uint32_t curve_count;
+	uint32_t index_count;
+	uint32_t band_count; /* bands per direction of every glyph */
+	uint32_t lut_offset;
+	uint32_t glyph_offset;
+	uint32_t curve_offset;
+	uint32_t band_offset;
+	uint32_t index_offset;
+	float space_advance;
+	float height;
+};
+
+struct curve_glyph_def {
+	float bbox[4]; /* left, bottom, right and top of the outline */
+	float advance[2];
+	uint32_t curve_first;
+	uint32_t curve_count;
+	uint8_t face; /* index of the source face in the fallback chain */
+	uint8_t reserved[3];
+};
+
+/*
+ * Control points of a curve, quantized over the box of its glyph: 0 is
+ * the left or bottom of the box and 65535 its right or top.
+ */
+struct curve_def {
+	uint16_t p[3][2];
+};
+
+/*
+ * Each glyph has band_count horizontal bands, bottom to top, followed by
+ * band_count vertical bands, left to right, splitting its box evenly.
+ * A band lists the curves crossing it as indices relative to the first
+ * curve of the glyph; horizontal bands sort them by decreasing right
+ * extent and vertical bands by decreasing top extent, so that a ray cast
+ * rightwards or upwards can stop at the first curve behind it.
+ */
+struct curve_band {
+	uint32_t index_first;
+	uint32_t index_count;
 };
 
 #endif /* RASTER_FONT_H */
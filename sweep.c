@@ -0,0 +1,584 @@
+#include "fr.h"
+#include "error.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Sweep mode: every font file of a directory tree is rasterized with the
+ * same options, each face of a collection being a job of its own. Font
+ * files are mapped once and their faces opened from memory, so the jobs
+ * of a collection share its pages, as do processes mapping the same
+ * file. Jobs are dealt largest file first to per-worker deques. A worker
+ * takes the largest job of its own deque, and once it is empty steals
+ * the largest one left in another deque, so that a big font queued
+ * behind a busy worker doesn't wait for it and finish last.
+ */
+
+/* A mapped font file */
+struct font_map {
+	char *path;
+	char *name; /* relative path, used to name the outputs */
+	void *data;
+	size_t size;
+	int num_faces;
+	int keep_extension; /* in output names */
+};
+
+struct sweep_job {
+	struct font_map *map;
+	int face_index;
+	char *atlas_filename;
+	char *metrics_filename;
+	const char *status; /* "ok", "failed" or "skipped" */
+	struct raster_stats stats; /* along with the reason of the status */
+	double time; /* in seconds */
+	long atlas_bytes;
+};
+
+/* Jobs of a worker, largest first, owner and thieves take from the head */
+struct deque {
+	int *jobs;
+	int head;
+	int tail;
+	pthread_mutex_t lock;
+};
+
+struct sweep {
+	const struct fr *fr;
+	struct font_map *maps;
+	int num_maps;
+	struct sweep_job *jobs;
+	int num_jobs;
+	struct deque *deques;
+	int num_workers;
+};
+
+struct worker {
+	struct sweep *sweep;
+	int index;
+	int num_done;
+	int num_stolen;
+	pthread_t thread;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int is_font_file(const char *name)
+{
+	static const char *extensions[] = {
+		".ttf", ".otf", ".ttc", ".otc", ".woff", ".woff2",
+		".pfb", ".pcf", ".bdf", NULL
+	};
+	const char *dot = strrchr(name, '.');
+	int i;
+
+	if (!dot)
+		return 0;
+	for (i = 0; extensions[i]; i++)
+		if (!strcasecmp(dot, extensions[i]))
+			return 1;
+
+	return 0;
+}
+
+static void add_map(struct sweep *sweep, const char *path, const char *name)
+{
+	struct font_map *map;
+
+	sweep->maps = realloc(sweep->maps,
+			      sizeof(struct font_map) * (sweep->num_maps + 1));
+	if (!sweep->maps)
+		die("out of memory");
+	map = &sweep->maps[sweep->num_maps++];
+	memset(map, 0, sizeof(*map));
+	map->path = strdup(path);
+	map->name = strdup(name);
+	if (!map->path || !map->name)
+		die("out of memory");
+}
+
+/* Gathers the font files below dir, name being dir relative to the root */
+static void walk_fonts(struct sweep *sweep, const char *dir, const char *name)
+{
+	struct dirent *entry;
+	struct stat st;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp) {
+		warning("unable to open directory %s", dir);
+		return;
+	}
+
+	while ((entry = readdir(dp))) {
+		char *path, *sub;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+		sub = malloc(strlen(name) + strlen(entry->d_name) + 2);
+		if (!path || !sub)
+			die("out of memory");
+		sprintf(path, "%s/%s", dir, entry->d_name);
+		if (*name)
+			sprintf(sub, "%s/%s", name, entry->d_name);
+		else
+			strcpy(sub, entry->d_name);
+
+		if (!stat(path, &st)) {
+			if (S_ISDIR(st.st_mode))
+				walk_fonts(sweep, path, sub);
+			else if (S_ISREG(st.st_mode) && is_font_file(entry->d_name))
+				add_map(sweep, path, sub);
+		}
+		free(path);
+		free(sub);
+	}
+	closedir(dp);
+}
+
+/*
+ * Maps a font file and counts its faces.
+ * Returns 0 or 1 if the file can't be mapped or is not a font.
+ */
+static int map_font(struct font_map *map, FT_Library library)
+{
+	struct stat st;
+	FT_Face face;
+	int fd;
+
+	fd = open(map->path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return 1;
+	}
+	map->size = st.st_size;
+	map->data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map->data == MAP_FAILED) {
+		map->data = NULL;
+		return 1;
+	}
+
+	/* A negative index only tells the number of faces */
+	if (FT_New_Memory_Face(library, map->data, map->size, -1, &face))
+		return 1;
+	map->num_faces = face->num_faces;
+	FT_Done_Face(face);
+
+	return 0;
+}
+
+/*
+ * Returns the output file name of a face for the given extension. Fonts
+ * keep their place in the tree below the output directory, and their own
+ * extension when another font of their directory has the same name.
+ */
+static char *job_filename(const struct fr *fr, const struct font_map *map,
+			  int face_index, const char *extension)
+{
+	const char *dot = strrchr(map->name, '.');
+	size_t len = dot - map->name;
+	char *s, *p;
+
+	s = malloc(strlen(fr->sweep_output) + strlen(map->name) +
+		   strlen(extension) + 24);
+	if (!s)
+		die("out of memory");
+	p = s + sprintf(s, "%s/%.*s", fr->sweep_output, (int)len, map->name);
+	if (map->keep_extension)
+		p += sprintf(p, "-%s", dot + 1);
+	if (map->num_faces > 1)
+		p += sprintf(p, "-%d", face_index);
+	sprintf(p, ".%s", extension);
+
+	return s;
+}
+
+static void set_job_filenames(struct sweep_job *job, const struct fr *fr)
+{
+	free(job->atlas_filename);
+	free(job->metrics_filename);
+	job->atlas_filename = job_filename(fr, job->map, job->face_index, "png");
+	job->metrics_filename = job_filename(fr, job->map, job->face_index,
+					     metrics_extension(fr->format));
+}
+
+static int compare_job_filenames(const void *a, const void *b)
+{
+	const struct sweep_job *ja = a;
+	const struct sweep_job *jb = b;
+
+	return strcmp(ja->atlas_filename, jb->atlas_filename);
+}
+
+/*
+ * Gives fonts sharing their output names, such as a.ttf and a.otf, or
+ * a.ttc and a-1.ttf, names with their extension. Dies if some are still
+ * alike.
+ */
+static void check_job_filenames(struct sweep *sweep)
+{
+	int i, renamed = 0;
+
+	qsort(sweep->jobs, sweep->num_jobs, sizeof(struct sweep_job),
+	      compare_job_filenames);
+	for (i = 1; i < sweep->num_jobs; i++) {
+		if (!strcmp(sweep->jobs[i - 1].atlas_filename,
+			    sweep->jobs[i].atlas_filename)) {
+			sweep->jobs[i - 1].map->keep_extension = 1;
+			sweep->jobs[i].map->keep_extension = 1;
+			renamed = 1;
+		}
+	}
+	if (!renamed)
+		return;
+
+	for (i = 0; i < sweep->num_jobs; i++)
+		if (sweep->jobs[i].map->keep_extension)
+			set_job_filenames(&sweep->jobs[i], sweep->fr);
+	qsort(sweep->jobs, sweep->num_jobs, sizeof(struct sweep_job),
+	      compare_job_filenames);
+	for (i = 1; i < sweep->num_jobs; i++)
+		if (!strcmp(sweep->jobs[i - 1].atlas_filename,
+			    sweep->jobs[i].atlas_filename))
+			die("%s and %s would both be written to %s",
+			    sweep->jobs[i - 1].map->path, sweep->jobs[i].map->path,
+			    sweep->jobs[i].atlas_filename);
+}
+
+/* Creates the missing directories leading to a file */
+static int make_parent_dirs(const char *filename)
+{
+	char *path = strdup(filename);
+	char *slash;
+	int err = 0;
+
+	if (!path)
+		return 1;
+	for (slash = strchr(path + 1, '/'); slash && !err;
+	     slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(path, 0777) && errno != EEXIST)
+			err = 1;
+		*slash = '/';
+	}
+	free(path);
+
+	return err;
+}
+
+static int compare_job_sizes(const void *a, const void *b)
+{
+	const struct sweep_job *ja = a;
+	const struct sweep_job *jb = b;
+
+	if (ja->map->size != jb->map->size)
+		return ja->map->size < jb->map->size ? 1 : -1;
+	return strcmp(ja->map->name, jb->map->name) ?
+	       strcmp(ja->map->name, jb->map->name) :
+	       ja->face_index - jb->face_index;
+}
+
+static int compare_job_names(const void *a, const void *b)
+{
+	const struct sweep_job *ja = a;
+	const struct sweep_job *jb = b;
+
+	return strcmp(ja->map->name, jb->map->name) ?
+	       strcmp(ja->map->name, jb->map->name) :
+	       ja->face_index - jb->face_index;
+}
+
+/* Returns the next job of the worker, stolen if need be, or -1 */
+static int next_job(struct worker *worker)
+{
+	struct sweep *sweep = worker->sweep;
+	int i, job = -1;
+
+	for (i = 0; i < sweep->num_workers && job < 0; i++) {
+		struct deque *dq = &sweep->deques[(worker->index + i) %
+						  sweep->num_workers];
+
+		pthread_mutex_lock(&dq->lock);
+		if (dq->head < dq->tail)
+			job = dq->jobs[dq->head++];
+		pthread_mutex_unlock(&dq->lock);
+		if (job >= 0 && i)
+			worker->num_stolen++;
+	}
+
+	return job;
+}
+
+/* Fails a job, the sweep going on with the others */
+static void fail_job(struct sweep_job *job, const char *reason)
+{
+	job->status = "failed";
+	snprintf(job->stats.failure, sizeof(job->stats.failure), "%s", reason);
+}
+
+/* Runs a job, library being NULL if the worker has none */
+static void run_job(struct sweep_job *job, FT_Library library,
+		    const struct fr *fr)
+{
+	struct fr job_fr = *fr;
+	face_t face;
+	FT_Face ft_face;
+	struct stat st;
+	int v;
+	double start = now();
+
+	if (!library) {
+		fail_job(job, "unable to initialize FreeType");
+		return;
+	}
+	if (make_parent_dirs(job->atlas_filename)) {
+		fail_job(job, "unable to create the output directory");
+		return;
+	}
+	if (FT_New_Memory_Face(library, job->map->data, job->map->size,
+			       job->face_index, &ft_face)) {
+		fail_job(job, "unable to load face");
+		return;
+	}
+
+	face.filename = job->map->path;
+	face.index = job->face_index;
+	face.next = NULL;
+	job_fr.faces = &face;
+	job_fr.num_faces = 1;
+	job_fr.atlas_filename = job->atlas_filename;
+	job_fr.metrics_filename = job->metrics_filename;
+	job_fr.option_verbose = 0;
+	job_fr.stats = &job->stats;
+
+	job->status = rasterize_font(&ft_face, 1, &job_fr) ? "failed" : "ok";
+	FT_Done_Face(ft_face);
+	job->time = now() - start;
+	if (job->stats.failure[0])
+		return;
+
+	if (!fr->num_variants) {
+		if (!stat(job->atlas_filename, &st))
+			job->atlas_bytes = st.st_size;
+		return;
+	}
+	for (v = 0; v < fr->num_variants; v++) {
+		char *filename = variant_filename(job->atlas_filename,
+						  fr->variants[v]);
+		if (filename && !stat(filename, &st))
+			job->atlas_bytes += st.st_size;
+		free(filename);
+	}
+}
+
+/* FreeType libraries are not shared among threads, faces are. */
+static void *sweep_worker(void *data)
+{
+	struct worker *worker = data;
+	struct sweep *sweep = worker->sweep;
+	FT_Library library;
+	int job;
+
+	if (FT_Init_FreeType(&library))
+		library = NULL;
+
+	while ((job = next_job(worker)) >= 0) {
+		run_job(&sweep->jobs[job], library, sweep->fr);
+		worker->num_done++;
+	}
+
+	if (library)
+		FT_Done_FreeType(library);
+	return NULL;
+}
+
+/*
+ * Tells why a face is left out of the sweep, bitmap fonts lacking a
+ * strike at a render size. Returns NULL to sweep the face.
+ */
+static const char *skip_face(FT_Library library, const struct font_map *map,
+			     int face_index, const struct fr *fr,
+			     char *reason, size_t size)
+{
+	FT_Face face;
+	int k;
+
+	if (FT_New_Memory_Face(library, map->data, map->size, face_index,
+			       &face)) {
+		snprintf(reason, size, "unable to load face");
+		return "failed";
+	}
+
+	for (k = 0; k < fr->num_sizes && !FT_IS_SCALABLE(face); k++) {
+		if (!has_strike(face, fr->pixel_heights[k])) {
+			snprintf(reason, size, "no %dpx strike",
+				 fr->pixel_heights[k]);
+			FT_Done_Face(face);
+			return "skipped";
+		}
+	}
+	FT_Done_Face(face);
+
+	return NULL;
+}
+
+/*
+ * Rasterizes every font of the sweep directory and reports each face.
+ * Returns 0 or 1 if any face failed.
+ */
+int sweep_fonts(const struct fr *fr)
+{
+	struct sweep sweep;
+	struct worker *workers;
+	FT_Library library;
+	double start = now(), busy = 0.0, wall;
+	int i, j, w, num_fonts = 0, num_runnable = 0;
+	int num_failed = 0, num_skipped = 0;
+
+	memset(&sweep, 0, sizeof(sweep));
+	sweep.fr = fr;
+	walk_fonts(&sweep, fr->sweep_dir, "");
+
+	if (FT_Init_FreeType(&library))
+		die("unable to initialize FreeType");
+	for (i = 0; i < sweep.num_maps; i++) {
+		struct font_map *map = &sweep.maps[i];
+
+		if (map_font(map, library)) {
+			warning("skipping %s (not a font)", map->path);
+			continue;
+		}
+		num_fonts++;
+		for (j = 0; j < map->num_faces; j++) {
+			struct sweep_job *job;
+
+			sweep.jobs = realloc(sweep.jobs, sizeof(struct sweep_job) *
+					     (sweep.num_jobs + 1));
+			if (!sweep.jobs)
+				die("out of memory");
+			job = &sweep.jobs[sweep.num_jobs++];
+			memset(job, 0, sizeof(*job));
+			job->map = map;
+			job->face_index = j;
+			set_job_filenames(job, fr);
+			job->status = skip_face(library, map, j, fr,
+						job->stats.failure,
+						sizeof(job->stats.failure));
+			if (!job->status)
+				num_runnable++;
+		}
+	}
+	FT_Done_FreeType(library);
+
+	if (!sweep.num_jobs)
+		die("no font found in %s", fr->sweep_dir);
+	check_job_filenames(&sweep);
+
+	/* Largest first, dealt in turn so that each deque is sorted too */
+	qsort(sweep.jobs, sweep.num_jobs, sizeof(struct sweep_job),
+	      compare_job_sizes);
+	sweep.num_workers = fr->jobs < num_runnable ? fr->jobs : num_runnable;
+	sweep.deques = calloc(sweep.num_workers, sizeof(struct deque));
+	workers = calloc(sweep.num_workers, sizeof(struct worker));
+	if (!sweep.deques || !workers)
+		die("out of memory");
+	for (w = 0; w < sweep.num_workers; w++) {
+		sweep.deques[w].jobs = malloc(sizeof(int) *
+					      (num_runnable / sweep.num_workers + 1));
+		if (!sweep.deques[w].jobs)
+			die("out of memory");
+		pthread_mutex_init(&sweep.deques[w].lock, NULL);
+	}
+	for (i = 0, j = 0; i < sweep.num_jobs; i++) {
+		struct deque *dq;
+
+		if (sweep.jobs[i].status)
+			continue;
+		dq = &sweep.deques[j++ % sweep.num_workers];
+		dq->jobs[dq->tail++] = i;
+	}
+
+	for (w = 0; w < sweep.num_workers; w++) {
+		workers[w].sweep = &sweep;
+		workers[w].index = w;
+		if (pthread_create(&workers[w].thread, NULL, sweep_worker,
+				   &workers[w]))
+			die("unable to start sweep workers");
+	}
+	for (w = 0; w < sweep.num_workers; w++)
+		pthread_join(workers[w].thread, NULL);
+	wall = now() - start;
+
+	qsort(sweep.jobs, sweep.num_jobs, sizeof(struct sweep_job),
+	      compare_job_names);
+	for (i = 0; i < sweep.num_jobs; i++) {
+		struct sweep_job *job = &sweep.jobs[i];
+
+		printf("%s", job->map->name);
+		if (job->map->num_faces > 1)
+			printf(":%d", job->face_index);
+		printf(": time=%.1fms glyphs=%d placed=%d atlas=%dx%d png=%ld "
+		       "status=%s", job->time * 1e3, job->stats.num_glyphs,
+		       job->stats.num_placed, fr->atlas_width, fr->atlas_height,
+		       job->atlas_bytes, job->status);
+		if (job->stats.failure[0])
+			printf(": %s", job->stats.failure);
+		printf("\n");
+		busy += job->time;
+		num_failed += !strcmp(job->status, "failed");
+		num_skipped += !strcmp(job->status, "skipped");
+	}
+	printf("sweep: %d faces of %d fonts in %.1f ms on %d workers "
+	       "(%.2fx), %d failed, %d skipped\n", sweep.num_jobs, num_fonts,
+	       wall * 1e3, sweep.num_workers, busy / wall, num_failed,
+	       num_skipped);
+	if (fr->option_verbose)
+		for (w = 0; w < sweep.num_workers; w++)
+			printf("worker %d: %d jobs, %d stolen\n", w,
+			       workers[w].num_done, workers[w].num_stolen);
+
+	for (i = 0; i < sweep.num_jobs; i++) {
+		free(sweep.jobs[i].atlas_filename);
+		free(sweep.jobs[i].metrics_filename);
+	}
+	for (i = 0; i < sweep.num_maps; i++) {
+		if (sweep.maps[i].data)
+			munmap(sweep.maps[i].data, sweep.maps[i].size);
+		free(sweep.maps[i].path);
+		free(sweep.maps[i].name);
+	}
+	for (w = 0; w < sweep.num_workers; w++) {
+		pthread_mutex_destroy(&sweep.deques[w].lock);
+		free(sweep.deques[w].jobs);
+	}
+	free(sweep.deques);
+	free(workers);
+	free(sweep.jobs);
+	free(sweep.maps);
+
+	return num_failed != 0;
+}